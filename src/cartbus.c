@@ -0,0 +1,277 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * CartBus
+ * PIO + DMA engine for the N64 PI bus.
+ * The PIO state machine drives ALEH/ALEL/READ and samples AD0-AD15 into the RX FIFO, a DMA channel moves the
+ * samples straight into the destination buffer. Writes and the odd status poll still use the bit-banged
+ * set_address()/write16() path, the pins are handed back and forth between the PIO and SIO on demand.
+ */
+
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "pico/mutex.h"
+#include "cartbus.pio.h"
+#include "n64cartinterface.h"
+#include "cartbus.h"
+#include "timing.h"
+
+#define CARTBUS_AD_MASK (0xFFFF)
+#define CARTBUS_CONTROL_MASK ((1u << N64_READ) | (1u << N64_ALEL) | (1u << N64_ALEH))
+
+static PIO CartBusPio = pio1;
+static uint CartBusSm;
+static uint CartBusOffset;
+static uint CartBusDma;
+static dma_channel_config CartBusDmaConfig;
+static uint CartBusTimingDma;
+static dma_channel_config CartBusTimingDmaConfig;
+static bool PioOwnsBus = false;
+
+// Serializes bus access between core0 and the core1 prefetcher.
+auto_init_mutex(CartBusMutex);
+
+static CartBusStream Stream = { 0, false };
+uint32_t gCartBusLatchCount = 0;
+
+#define CARTBUS_DEFAULT_TIMING { CARTBUS_LATCH_NS, CARTBUS_LATENCY_NS, CARTBUS_READ_LOW_NS, CARTBUS_READ_HIGH_NS }
+static const CartBusTiming DefaultTiming = CARTBUS_DEFAULT_TIMING;
+CartBusTiming gCartBusTiming = CARTBUS_DEFAULT_TIMING;
+bool gCartBusCalibrated = false;
+
+// gCartBusTiming converted to PIO cycles, the state machine runs at clk_sys.
+static uint32_t LatchCycles;
+static uint32_t LatencyCycles;
+static uint32_t ReadCycles; // (/READ low << 16) | /READ high, fed to the read loop once per halfword.
+
+// Calibration candidates in ns, fastest first.
+static const uint16_t ReadLowCandidates[] = { 40, 56, 72, 88, 104, 120, 144, 168, 200, 232, 264 };
+static const uint16_t LatchCandidates[] = { 0, 8, 16, 24, 32, 40, 56 };
+#define CALIBRATION_PASSES (4)
+#define CALIBRATION_SIZE (0x1000)
+
+void cartbus_init(void)
+{
+    CartBusOffset = pio_add_program(CartBusPio, &cartbus_program);
+    CartBusSm = (uint)pio_claim_unused_sm(CartBusPio, true);
+
+    pio_sm_config config = cartbus_program_get_default_config(CartBusOffset);
+    sm_config_set_out_pins(&config, 0, 16);
+    sm_config_set_in_pins(&config, 0);
+    sm_config_set_set_pins(&config, N64_ALEL, 2);
+    sm_config_set_sideset_pins(&config, N64_READ);
+    // The address goes out high halfword first, samples are packed first halfword low.
+    sm_config_set_out_shift(&config, false, false, 32);
+    sm_config_set_in_shift(&config, true, true, 32);
+    sm_config_set_clkdiv(&config, 1);
+    cartbus_set_timing(&gCartBusTiming);
+
+    pio_sm_init(CartBusPio, CartBusSm, CartBusOffset + cartbus_offset_read, &config);
+    pio_sm_set_enabled(CartBusPio, CartBusSm, true);
+
+    CartBusDma = (uint)dma_claim_unused_channel(true);
+    CartBusDmaConfig = dma_channel_get_default_config(CartBusDma);
+    channel_config_set_transfer_data_size(&CartBusDmaConfig, DMA_SIZE_32);
+    channel_config_set_read_increment(&CartBusDmaConfig, false);
+    channel_config_set_write_increment(&CartBusDmaConfig, true);
+    channel_config_set_dreq(&CartBusDmaConfig, pio_get_dreq(CartBusPio, CartBusSm, false));
+
+    CartBusTimingDma = (uint)dma_claim_unused_channel(true);
+    CartBusTimingDmaConfig = dma_channel_get_default_config(CartBusTimingDma);
+    channel_config_set_transfer_data_size(&CartBusTimingDmaConfig, DMA_SIZE_32);
+    channel_config_set_read_increment(&CartBusTimingDmaConfig, false);
+    channel_config_set_write_increment(&CartBusTimingDmaConfig, false);
+    channel_config_set_dreq(&CartBusTimingDmaConfig, pio_get_dreq(CartBusPio, CartBusSm, true));
+}
+
+void cartbus_set_timing(const CartBusTiming *timing)
+{
+    gCartBusTiming = *timing;
+    LatchCycles = timing_ns_to_cycles(timing->LatchNs);
+    LatencyCycles = timing_ns_to_cycles(timing->LatencyNs);
+
+    // The read loop adds 3 cycles of its own to both the /READ low and high time.
+    uint32_t ReadLowCycles = timing_ns_to_cycles(timing->ReadLowNs);
+    uint32_t ReadHighCycles = timing_ns_to_cycles(timing->ReadHighNs);
+    ReadLowCycles = (ReadLowCycles > 3) ? MIN(ReadLowCycles - 3, 0xFFFF) : 0;
+    ReadHighCycles = (ReadHighCycles > 3) ? MIN(ReadHighCycles - 3, 0xFFFF) : 0;
+    ReadCycles = (ReadLowCycles << 16) | ReadHighCycles;
+}
+
+void cartbus_lock(void)
+{
+    mutex_enter_blocking(&CartBusMutex);
+}
+
+void cartbus_unlock(void)
+{
+    mutex_exit(&CartBusMutex);
+}
+
+static void cartbus_claim(void)
+{
+    if (PioOwnsBus != false) {
+        return;
+    }
+
+    // Match the idle state of the bit-banged bus before the pins are switched over: /READ high, ALEs low, AD input.
+    pio_sm_set_enabled(CartBusPio, CartBusSm, false);
+    pio_sm_set_pins_with_mask(CartBusPio, CartBusSm, (1u << N64_READ), CARTBUS_CONTROL_MASK);
+    pio_sm_set_pindirs_with_mask(CartBusPio, CartBusSm, CARTBUS_CONTROL_MASK, CARTBUS_CONTROL_MASK | CARTBUS_AD_MASK);
+    pio_sm_set_enabled(CartBusPio, CartBusSm, true);
+
+    for (uint i = 0; i < 16; i += 1) {
+        pio_gpio_init(CartBusPio, i);
+    }
+
+    pio_gpio_init(CartBusPio, N64_READ);
+    pio_gpio_init(CartBusPio, N64_ALEL);
+    pio_gpio_init(CartBusPio, N64_ALEH);
+    PioOwnsBus = true;
+}
+
+void cartbus_release(void)
+{
+    // Whatever comes next on the bit-banged path moves the cart address.
+    Stream.Valid = false;
+    if (PioOwnsBus == false) {
+        return;
+    }
+
+    // The SIO output and direction registers still hold the state of the last bit-banged access.
+    for (uint i = 0; i < 16; i += 1) {
+        gpio_set_function(i, GPIO_FUNC_SIO);
+    }
+
+    gpio_set_function(N64_READ, GPIO_FUNC_SIO);
+    gpio_set_function(N64_ALEL, GPIO_FUNC_SIO);
+    gpio_set_function(N64_ALEH, GPIO_FUNC_SIO);
+    PioOwnsBus = false;
+}
+
+// Streaming read, only latches a new address when the read does not continue where the last one stopped
+// or when it starts a new page. Length is in bytes and has to be a multiple of 4, the address and the buffer have to be
+// word aligned: chunks end at page boundaries and the DMA moves whole words, so a chunk must not end on a halfword.
+void __time_critical_func(cart_read_burst)(uint32_t address, uint16_t *buffer, uint32_t length)
+{
+    assert(((length & 3) == 0) && ((((uintptr_t)buffer) & 3) == 0));
+    assert((address & 3) == 0);
+    cartbus_claim();
+
+    while (length != 0) {
+        bool Latch;
+        uint32_t chunk = cartbus_stream_chunk(&Stream, address, length, &Latch);
+        if (Latch != false) {
+            // The state machine parks on the read pull once the previous burst has been drained.
+            while (pio_sm_get_pc(CartBusPio, CartBusSm) != (CartBusOffset + cartbus_offset_read)) {
+                tight_loop_contents();
+            }
+
+            pio_sm_exec(CartBusPio, CartBusSm, pio_encode_jmp(CartBusOffset + cartbus_offset_latch));
+        }
+
+        dma_channel_configure(CartBusDma, &CartBusDmaConfig, buffer, &CartBusPio->rxf[CartBusSm], chunk / 4, true);
+        if (Latch != false) {
+            pio_sm_put_blocking(CartBusPio, CartBusSm, LatchCycles);
+            pio_sm_put_blocking(CartBusPio, CartBusSm, address);
+            pio_sm_put_blocking(CartBusPio, CartBusSm, LatencyCycles);
+            gCartBusLatchCount += 1;
+        }
+
+        // One timing word per halfword, the state machine parks on the read pull again after the last one.
+        dma_channel_configure(CartBusTimingDma, &CartBusTimingDmaConfig, &CartBusPio->txf[CartBusSm], &ReadCycles,
+                              chunk / 2, true);
+
+        dma_channel_wait_for_finish_blocking(CartBusDma);
+
+        address += chunk;
+        buffer += chunk / 2;
+        length -= chunk;
+        cartbus_stream_advance(&Stream, address);
+    }
+}
+
+// Read the header and the boot code at the current timing and return the CRCs of both.
+static void cartbus_read_reference(uint32_t *HeaderCrc, uint32_t *BootCrc)
+{
+    cart_read_burst(CART_ADDRESS_START, (uint16_t*)readarr, CALIBRATION_SIZE);
+    *HeaderCrc = si_crc32((uint8_t*)readarr, 0x40);
+    *BootCrc = si_crc32(((uint8_t*)readarr) + 0x40, CALIBRATION_SIZE - 0x40);
+}
+
+static bool cartbus_timing_stable(uint32_t HeaderCrc, uint32_t BootCrc)
+{
+    for (uint32_t Pass = 0; Pass < CALIBRATION_PASSES; Pass += 1) {
+        uint32_t Crc[2];
+        cartbus_read_reference(&Crc[0], &Crc[1]);
+        if ((Crc[0] != HeaderCrc) || (Crc[1] != BootCrc)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Sweep the /READ low time and then the latch hold time from aggressive to conservative.
+// Every candidate has to reproduce the header and boot code CRCs read at twice the default timings,
+// the first stable candidate gets a safety margin on top. Marginal carts simply end up near the defaults.
+void cartbus_calibrate(void)
+{
+    CartBusTiming Safe = { CARTBUS_LATCH_NS * 2, CARTBUS_LATENCY_NS, CARTBUS_READ_LOW_NS * 2,
+                           CARTBUS_READ_HIGH_NS * 2 };
+    CartBusTiming Candidate = Safe;
+    uint32_t HeaderCrc;
+    uint32_t BootCrc;
+
+    cartbus_set_timing(&Safe);
+    cartbus_read_reference(&HeaderCrc, &BootCrc);
+    if ((((uint16_t*)readarr)[0] != 0x8037) || (cartbus_timing_stable(HeaderCrc, BootCrc) == false)) {
+        // Not even the slow timing reads back consistently, stay at the defaults.
+        cartbus_set_timing(&DefaultTiming);
+        gCartBusCalibrated = false;
+        return;
+    }
+
+    // The /READ high time is not swept, the candidates run at the default like the final timing.
+    Candidate.ReadHighNs = DefaultTiming.ReadHighNs;
+
+    // A value the sweep found stable gets a margin, without one the default is kept as is.
+    uint32_t ReadLow = DefaultTiming.ReadLowNs;
+    for (uint32_t i = 0; i < (sizeof(ReadLowCandidates) / sizeof(ReadLowCandidates[0])); i += 1) {
+        Candidate.ReadLowNs = ReadLowCandidates[i];
+        cartbus_set_timing(&Candidate);
+        if (cartbus_timing_stable(HeaderCrc, BootCrc) != false) {
+            // A quarter extra with a minimum of 16ns.
+            ReadLow = ReadLowCandidates[i];
+            ReadLow += (ReadLow / 4 > 16) ? (ReadLow / 4) : 16;
+            break;
+        }
+    }
+
+    Candidate.ReadLowNs = ReadLow;
+
+    uint32_t Latch = DefaultTiming.LatchNs;
+    for (uint32_t i = 0; i < (sizeof(LatchCandidates) / sizeof(LatchCandidates[0])); i += 1) {
+        Candidate.LatchNs = LatchCandidates[i];
+        cartbus_set_timing(&Candidate);
+        if (cartbus_timing_stable(HeaderCrc, BootCrc) != false) {
+            Latch = LatchCandidates[i] + 16;
+            break;
+        }
+    }
+
+    Candidate.LatchNs = Latch;
+    cartbus_set_timing(&Candidate);
+
+    // Final check of the combination, fall back to the defaults if it does not hold up.
+    if (cartbus_timing_stable(HeaderCrc, BootCrc) == false) {
+        cartbus_set_timing(&DefaultTiming);
+        gCartBusCalibrated = false;
+        return;
+    }
+
+    gCartBusCalibrated = true;
+}
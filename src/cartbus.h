@@ -0,0 +1,71 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * CartBus
+ * PIO + DMA engine for the N64 PI bus, latches the address and streams halfwords into memory
+ * without any CPU work per halfword.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The cart only auto-increments within the 512 byte page of the PI, a new address has to be latched for every page.
+#define CARTBUS_PAGE_SIZE (0x200)
+
+// Default bus timings in ns, converted to PIO cycles for the running system clock. Used until calibration found faster ones.
+#define CARTBUS_LATCH_NS    (56)   // Address hold time on both ALE edges.
+#define CARTBUS_LATENCY_NS  (1000) // ALEL low to the first /READ, like the PI default.
+#define CARTBUS_READ_LOW_NS (264)  // /READ low time.
+#define CARTBUS_READ_HIGH_NS (64)  // /READ high time between halfwords of a burst.
+
+// Latch bookkeeping of a streaming read. Address is what the cart returns on the next /READ, only valid while
+// nothing else touched the bus.
+typedef struct _CartBusStream
+{
+    uint32_t Address;
+    bool Valid;
+} CartBusStream;
+
+// Length of the next chunk of a burst, a chunk never crosses a page. Latch is set when the chunk needs a new address:
+// the stream was broken, the read does not continue where the last one stopped or it starts a new page.
+// Free of hardware access so the host tests can run it against a simulated cart.
+static inline uint32_t cartbus_stream_chunk(const CartBusStream *stream, uint32_t address, uint32_t length, bool *latch)
+{
+    uint32_t chunk = CARTBUS_PAGE_SIZE - (address & (CARTBUS_PAGE_SIZE - 1));
+    if (chunk > length) {
+        chunk = length;
+    }
+
+    *latch = (stream->Valid == false) || (address != stream->Address) || ((address & (CARTBUS_PAGE_SIZE - 1)) == 0);
+    return chunk;
+}
+
+// The cart auto-increments past every halfword it returned.
+static inline void cartbus_stream_advance(CartBusStream *stream, uint32_t address)
+{
+    stream->Address = address;
+    stream->Valid = true;
+}
+
+typedef struct _CartBusTiming
+{
+    uint32_t LatchNs;
+    uint32_t LatencyNs;
+    uint32_t ReadLowNs;
+    uint32_t ReadHighNs;
+} CartBusTiming;
+
+void cartbus_init(void);
+void cartbus_calibrate(void);
+void cartbus_set_timing(const CartBusTiming *timing);
+void cart_read_burst(uint32_t address, uint16_t *buffer, uint32_t length);
+void cartbus_release(void);
+void cartbus_lock(void);
+void cartbus_unlock(void);
+
+extern uint32_t gCartBusLatchCount;
+extern CartBusTiming gCartBusTiming;
+extern bool gCartBusCalibrated;
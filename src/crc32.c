@@ -0,0 +1,69 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Crc32
+ * Table driven zip CRC32 for the header and boot code checks, the ROM size probe and the flash cache index.
+ * Free of hardware access so the host tests can check it against the bitwise definition.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "crc32.h"
+
+// Slicing-by-8, CrcTable[0] is the classic bytewise table and CrcTable[k] advances it by k more zero bytes.
+static uint32_t CrcTable[8][256];
+static bool TableBuilt = false;
+uint32_t si_crc32(const uint8_t *data, size_t size) {
+    uint32_t c;
+
+    // No need to recompute the tables on every invocation.
+    if (TableBuilt == false) {
+        for (uint32_t n = 0; n < 256; n += 1) {
+            c = n;
+            for (uint32_t k = 0; k < 8; k += 1) {
+                c = ((c & 1) != 0) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            }
+
+            CrcTable[0][n] = c;
+        }
+
+        for (uint32_t n = 0; n < 256; n += 1) {
+            c = CrcTable[0][n];
+            for (uint32_t k = 1; k < 8; k += 1) {
+                c = CrcTable[0][c & 0xFF] ^ (c >> 8);
+                CrcTable[k][n] = c;
+            }
+        }
+
+        TableBuilt = true;
+    }
+
+    c = 0xFFFFFFFF;
+    while ((size != 0) && ((((uintptr_t)data) & 3) != 0)) {
+        c = CrcTable[0][(c ^ *data) & 0xFF] ^ (c >> 8);
+        data += 1;
+        size -= 1;
+    }
+
+    // Eight bytes per step from word aligned loads, the RP2040 is little endian.
+    while (size >= 8) {
+        uint32_t One = ((const uint32_t*)data)[0] ^ c;
+        uint32_t Two = ((const uint32_t*)data)[1];
+        c = CrcTable[7][One & 0xFF] ^ CrcTable[6][(One >> 8) & 0xFF] ^
+            CrcTable[5][(One >> 16) & 0xFF] ^ CrcTable[4][One >> 24] ^
+            CrcTable[3][Two & 0xFF] ^ CrcTable[2][(Two >> 8) & 0xFF] ^
+            CrcTable[1][(Two >> 16) & 0xFF] ^ CrcTable[0][Two >> 24];
+        data += 8;
+        size -= 8;
+    }
+
+    while (size != 0) {
+        c = CrcTable[0][(c ^ *data) & 0xFF] ^ (c >> 8);
+        data += 1;
+        size -= 1;
+    }
+
+    return c ^ 0xFFFFFFFF;
+}
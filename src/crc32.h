@@ -0,0 +1,14 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Crc32
+ * Table driven zip CRC32.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t si_crc32(const uint8_t *data, size_t size);
@@ -0,0 +1,445 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * FlashCache
+ * Persistent copy of cart ROMs in the onboard QSPI flash, keyed by the header CRC, game code and ROM size.
+ * The region after the firmware starts with two index sectors, followed by one extent per cart. The index is written
+ * to the older of the two sectors with the next sequence number, a write cut short by a reset leaves the other one.
+ * It is only written when the extents or the order of use change, booting the same cart again writes nothing.
+ * An extent holds a block map (one halfword per 4KB ROM block) and the data sectors, allocated in the order the
+ * blocks got stored.
+ * Blocks filled with 0xFF or 0x00 (ROM padding) only take a map entry. Map entries are programmed after their
+ * data, so a block interrupted by a reset or host crash is simply stored again.
+ *
+ * Core1 mirrors the ROM into flash while the host is idle, ROM cache fills are served from flash through XIP
+ * once a block is stored. Carts are evicted least recently attached first when a new cart does not fit.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "n64cartinterface.h"
+#include "cartbus.h"
+#include "romcache.h"
+#include "flashcache.h"
+
+bool gFlashCacheAttached = false;
+uint32_t gFlashCacheHits = 0;
+uint32_t gFlashCacheStored = 0;
+
+#ifdef DRMDMP_FLASH_CACHE
+
+#define FLASHCACHE_MAGIC   (0x32463436) // "64F2"
+#define FLASHCACHE_INDEX_SECTORS (2)
+#define FLASHCACHE_SECTORS ((FLASHCACHE_FLASH_SIZE - FLASHCACHE_OFFSET) / FLASH_SECTOR_SIZE)
+
+// Block map entries, anything below FLASHCACHE_FILL_00 is a data sector of the extent.
+#define FLASHCACHE_EMPTY   (0xFFFF)
+#define FLASHCACHE_FILL_FF (0xFFFE)
+#define FLASHCACHE_FILL_00 (0xFFFD)
+
+static_assert(ROMCACHE_BLOCK_SIZE == FLASH_SECTOR_SIZE, "ROM blocks are stored one per flash sector");
+static_assert((FLASHCACHE_OFFSET % FLASH_SECTOR_SIZE) == 0, "the cache region has to start on a sector");
+
+typedef struct _FlashCacheCart
+{
+    uint32_t HeaderCrc;
+    uint32_t RomSize;
+    uint32_t Start;     // Sector of the block map, relative to FLASHCACHE_OFFSET.
+    uint32_t Sectors;   // Map and data sectors, 0 for an unused entry.
+    uint32_t LastUse;
+    uint16_t GameCode[2];
+} FlashCacheCart;
+
+typedef union _FlashCacheIndex
+{
+    struct {
+        uint32_t Magic;
+        uint32_t Sequence;  // Higher of the two copies is the current one.
+        uint32_t Crc;       // Over everything from Tick on, catches a copy whose programming was cut short.
+        uint32_t Tick;
+        FlashCacheCart Carts[FLASHCACHE_CARTS];
+    };
+
+    uint8_t Raw[2 * FLASH_PAGE_SIZE];
+} FlashCacheIndex;
+
+static_assert(sizeof(FlashCacheIndex) == (2 * FLASH_PAGE_SIZE), "index does not fit the reserved pages");
+static_assert(FLASHCACHE_INDEX_SECTORS == 2, "the index alternates between two sectors");
+
+// End of the firmware image, provided by the linker script.
+extern char __flash_binary_end;
+
+static FlashCacheIndex Index;
+static uint32_t IndexSector;
+static FlashCacheCart *Cart;
+static const uint16_t *Map;
+static uint32_t MapSectors;
+static uint32_t BlockCount;
+static uint32_t NextSector;
+static uint32_t MirrorBlock;
+static uint32_t MirrorBuffer[FLASH_SECTOR_SIZE / 4];
+
+static inline uint32_t flashcache_offset(uint32_t sector)
+{
+    return FLASHCACHE_OFFSET + (sector * FLASH_SECTOR_SIZE);
+}
+
+// Erase when data is NULL. Nothing may run from flash meanwhile, core1 locks core0 out for the duration.
+// The lockout handshake drains the inter-core FIFO, core0 requests anything it still waits on again.
+static void flashcache_flash_op(uint32_t offset, const uint8_t *data, uint32_t length)
+{
+    bool Lockout = (get_core_num() == 1);
+    if (Lockout != false) {
+        multicore_lockout_start_blocking();
+    }
+
+    uint32_t Irq = save_and_disable_interrupts();
+    if (data == NULL) {
+        flash_range_erase(offset, length);
+    } else {
+        flash_range_program(offset, data, length);
+    }
+
+    restore_interrupts(Irq);
+    if (Lockout != false) {
+        multicore_lockout_end_blocking();
+    }
+}
+
+static uint32_t flashcache_index_crc(const FlashCacheIndex *index)
+{
+    uint32_t Start = offsetof(FlashCacheIndex, Tick);
+    return si_crc32(&index->Raw[Start], sizeof(index->Raw) - Start);
+}
+
+static bool flashcache_index_valid(const FlashCacheIndex *index)
+{
+    return (index->Magic == FLASHCACHE_MAGIC) && (index->Crc == flashcache_index_crc(index));
+}
+
+// Picks the newer valid copy of the index, or starts an empty one.
+static void flashcache_load_index(void)
+{
+    const FlashCacheIndex *Copy[FLASHCACHE_INDEX_SECTORS];
+    bool Valid[FLASHCACHE_INDEX_SECTORS];
+    for (uint32_t i = 0; i < FLASHCACHE_INDEX_SECTORS; i += 1) {
+        Copy[i] = (const FlashCacheIndex*)(XIP_BASE + flashcache_offset(i));
+        Valid[i] = flashcache_index_valid(Copy[i]);
+    }
+
+    if ((Valid[0] == false) && (Valid[1] == false)) {
+        memset(Index.Raw, 0, sizeof(Index.Raw));
+        Index.Magic = FLASHCACHE_MAGIC;
+        IndexSector = 1;
+        return;
+    }
+
+    IndexSector = 0;
+    if ((Valid[0] == false) || ((Valid[1] != false) && ((int32_t)(Copy[1]->Sequence - Copy[0]->Sequence) > 0))) {
+        IndexSector = 1;
+    }
+
+    memcpy(Index.Raw, Copy[IndexSector]->Raw, sizeof(Index.Raw));
+}
+
+// Writes the index over the older copy, the current one stays intact until the new one is complete.
+static void flashcache_write_index(void)
+{
+    IndexSector ^= 1;
+    Index.Sequence += 1;
+    Index.Crc = flashcache_index_crc(&Index);
+    flashcache_flash_op(flashcache_offset(IndexSector), NULL, FLASH_SECTOR_SIZE);
+    flashcache_flash_op(flashcache_offset(IndexSector), Index.Raw, sizeof(Index.Raw));
+}
+
+// First fit between the extents in the index, returns 0 if no gap is big enough.
+// The largest gap is returned as well for carts that do not fit the region at all.
+static uint32_t flashcache_find_gap(uint32_t sectors, uint32_t *largest_start, uint32_t *largest_size)
+{
+    *largest_start = 0;
+    *largest_size = 0;
+    for (int32_t i = -1; i < FLASHCACHE_CARTS; i += 1) {
+        uint32_t Start = FLASHCACHE_INDEX_SECTORS;
+        if (i >= 0) {
+            if (Index.Carts[i].Sectors == 0) {
+                continue;
+            }
+
+            Start = Index.Carts[i].Start + Index.Carts[i].Sectors;
+        }
+
+        uint32_t End = FLASHCACHE_SECTORS;
+        for (uint32_t j = 0; j < FLASHCACHE_CARTS; j += 1) {
+            const FlashCacheCart *Other = &Index.Carts[j];
+            if (Other->Sectors == 0) {
+                continue;
+            }
+
+            if ((Start >= Other->Start) && (Start < (Other->Start + Other->Sectors))) {
+                End = Start;
+                break;
+            }
+
+            if ((Other->Start >= Start) && (Other->Start < End)) {
+                End = Other->Start;
+            }
+        }
+
+        if ((End - Start) >= sectors) {
+            return Start;
+        }
+
+        if ((End - Start) > *largest_size) {
+            *largest_start = Start;
+            *largest_size = End - Start;
+        }
+    }
+
+    return 0;
+}
+
+// Oldest cart in the index, or NULL if there are none left.
+static FlashCacheCart* flashcache_oldest(void)
+{
+    FlashCacheCart *Oldest = NULL;
+    for (uint32_t i = 0; i < FLASHCACHE_CARTS; i += 1) {
+        if ((Index.Carts[i].Sectors != 0) && ((Oldest == NULL) || (Index.Carts[i].LastUse < Oldest->LastUse))) {
+            Oldest = &Index.Carts[i];
+        }
+    }
+
+    return Oldest;
+}
+
+static FlashCacheCart* flashcache_create(uint32_t HeaderCrc)
+{
+    uint32_t Wanted = MapSectors + BlockCount;
+    uint32_t Start;
+    uint32_t Sectors = Wanted;
+    FlashCacheCart *Entry = NULL;
+
+    while (1) {
+        uint32_t LargestStart;
+        uint32_t LargestSize;
+        Start = flashcache_find_gap(Wanted, &LargestStart, &LargestSize);
+        for (uint32_t i = 0; (i < FLASHCACHE_CARTS) && (Entry == NULL); i += 1) {
+            if (Index.Carts[i].Sectors == 0) {
+                Entry = &Index.Carts[i];
+            }
+        }
+
+        if ((Start != 0) && (Entry != NULL)) {
+            break;
+        }
+
+        FlashCacheCart *Oldest = flashcache_oldest();
+        if (Oldest == NULL) {
+            // The region is empty and still too small, store as much of the ROM as fits.
+            if (LargestSize <= MapSectors) {
+                return NULL;
+            }
+
+            Start = LargestStart;
+            Sectors = LargestSize;
+            break;
+        }
+
+        Oldest->Sectors = 0;
+    }
+
+    // The map has to read back erased before the index points at it.
+    flashcache_flash_op(flashcache_offset(Start), NULL, MapSectors * FLASH_SECTOR_SIZE);
+    Entry->HeaderCrc = HeaderCrc;
+    Entry->RomSize = gRomSize;
+    Entry->Start = Start;
+    Entry->Sectors = Sectors;
+    Entry->GameCode[0] = gGameCode[0];
+    Entry->GameCode[1] = gGameCode[1];
+    return Entry;
+}
+
+// Looks up the inserted cart and creates an extent for it if it is not in the index yet.
+// Runs on core1 after the cart probe, core0 has to be set up as lockout victim by then.
+void flashcache_init(void)
+{
+    if (((uintptr_t)(&__flash_binary_end) - XIP_BASE) > FLASHCACHE_OFFSET) {
+        // The firmware grew into the cache region.
+        return;
+    }
+
+    uint32_t Header[0x40 / 4];
+    cartbus_lock();
+    cart_read_burst(CART_ADDRESS_START, (uint16_t*)Header, sizeof(Header));
+    cartbus_unlock();
+    uint32_t HeaderCrc = si_crc32((const uint8_t*)Header, sizeof(Header));
+
+    BlockCount = gRomSize / FLASH_SECTOR_SIZE;
+    MapSectors = ((BlockCount * 2) + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    flashcache_load_index();
+
+    Cart = NULL;
+    for (uint32_t i = 0; i < FLASHCACHE_CARTS; i += 1) {
+        FlashCacheCart *Entry = &Index.Carts[i];
+        if ((Entry->Sectors != 0) && (Entry->HeaderCrc == HeaderCrc) && (Entry->RomSize == gRomSize) &&
+            (Entry->GameCode[0] == gGameCode[0]) && (Entry->GameCode[1] == gGameCode[1])) {
+            Cart = Entry;
+            break;
+        }
+    }
+
+    bool Created = false;
+    if (Cart == NULL) {
+        Cart = flashcache_create(HeaderCrc);
+        if (Cart == NULL) {
+            return;
+        }
+
+        Created = true;
+    }
+
+    // A new extent or a different cart than last time changes the eviction order, the same cart again changes nothing.
+    if ((Created != false) || (Cart->LastUse != Index.Tick)) {
+        Index.Tick += 1;
+        Cart->LastUse = Index.Tick;
+        flashcache_write_index();
+    }
+
+    // Carry on where the last session stopped.
+    Map = (const uint16_t*)(XIP_BASE + flashcache_offset(Cart->Start));
+    NextSector = 0;
+    gFlashCacheStored = 0;
+    for (uint32_t i = 0; i < BlockCount; i += 1) {
+        if (Map[i] != FLASHCACHE_EMPTY) {
+            gFlashCacheStored += 1;
+            if ((Map[i] < FLASHCACHE_FILL_00) && (Map[i] >= NextSector)) {
+                NextSector = Map[i] + 1u;
+            }
+        }
+    }
+
+    MirrorBlock = 0;
+    gFlashCacheAttached = true;
+}
+
+// Fill a ROM cache block from flash, returns false if the block is not stored yet.
+bool flashcache_read_block(uint32_t address, uint32_t *buffer)
+{
+    if (gFlashCacheAttached == false) {
+        return false;
+    }
+
+    uint32_t Block = (address - CART_ADDRESS_START) / FLASH_SECTOR_SIZE;
+    if (Block >= BlockCount) {
+        return false;
+    }
+
+    uint16_t Entry = Map[Block];
+    if (Entry == FLASHCACHE_EMPTY) {
+        return false;
+    }
+
+    if (Entry == FLASHCACHE_FILL_FF) {
+        memset(buffer, 0xFF, FLASH_SECTOR_SIZE);
+    } else if (Entry == FLASHCACHE_FILL_00) {
+        memset(buffer, 0, FLASH_SECTOR_SIZE);
+    } else {
+        // Bypass the XIP cache, the firmware itself runs from it.
+        uint32_t Offset = flashcache_offset(Cart->Start + MapSectors + Entry);
+        memcpy(buffer, (const void*)(XIP_NOCACHE_NOALLOC_BASE + Offset), FLASH_SECTOR_SIZE);
+    }
+
+    gFlashCacheHits += 1;
+    return true;
+}
+
+static uint16_t flashcache_fill_entry(const uint32_t *data)
+{
+    if ((data[0] != 0) && (data[0] != 0xFFFFFFFF)) {
+        return FLASHCACHE_EMPTY;
+    }
+
+    for (uint32_t i = 1; i < (FLASH_SECTOR_SIZE / 4); i += 1) {
+        if (data[i] != data[0]) {
+            return FLASHCACHE_EMPTY;
+        }
+    }
+
+    return (data[0] == 0) ? FLASHCACHE_FILL_00 : FLASHCACHE_FILL_FF;
+}
+
+// Store the next missing block, called by core1 whenever it has nothing else to do.
+// Returns false once the ROM is stored completely or the extent is full.
+bool flashcache_mirror_step(void)
+{
+    if (gFlashCacheAttached == false) {
+        return false;
+    }
+
+    while ((MirrorBlock < BlockCount) && (Map[MirrorBlock] != FLASHCACHE_EMPTY)) {
+        MirrorBlock += 1;
+    }
+
+    if (MirrorBlock >= BlockCount) {
+        if (Cart->Sectors > (MapSectors + NextSector)) {
+            // Give the sectors saved on padding back to the other carts.
+            Cart->Sectors = MapSectors + NextSector;
+            flashcache_write_index();
+        }
+
+        return false;
+    }
+
+    cartbus_lock();
+    cart_read_burst(CART_ADDRESS_START + (MirrorBlock * FLASH_SECTOR_SIZE), (uint16_t*)MirrorBuffer, FLASH_SECTOR_SIZE);
+    cartbus_unlock();
+
+    uint16_t Entry = flashcache_fill_entry(MirrorBuffer);
+    if (Entry == FLASHCACHE_EMPTY) {
+        if ((MapSectors + NextSector) >= Cart->Sectors) {
+            // Out of space, the rest of the ROM keeps coming from the bus.
+            return false;
+        }
+
+        uint32_t Offset = flashcache_offset(Cart->Start + MapSectors + NextSector);
+        flashcache_flash_op(Offset, NULL, FLASH_SECTOR_SIZE);
+        flashcache_flash_op(Offset, (const uint8_t*)MirrorBuffer, FLASH_SECTOR_SIZE);
+        Entry = (uint16_t)NextSector;
+        NextSector += 1;
+    }
+
+    // Erased bits stay untouched, so only the one map entry changes in the page.
+    uint8_t Page[FLASH_PAGE_SIZE];
+    uint32_t MapOffset = MirrorBlock * 2;
+    memset(Page, 0xFF, sizeof(Page));
+    memcpy(&Page[MapOffset % FLASH_PAGE_SIZE], &Entry, sizeof(Entry));
+    flashcache_flash_op(flashcache_offset(Cart->Start) + (MapOffset & ~(FLASH_PAGE_SIZE - 1)), Page, sizeof(Page));
+
+    gFlashCacheStored += 1;
+    MirrorBlock += 1;
+    return true;
+}
+
+#else
+
+void flashcache_init(void)
+{
+}
+
+bool flashcache_read_block(uint32_t address, uint32_t *buffer)
+{
+    (void)address;
+    (void)buffer;
+    return false;
+}
+
+bool flashcache_mirror_step(void)
+{
+    return false;
+}
+
+#endif
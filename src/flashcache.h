@@ -0,0 +1,33 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * FlashCache
+ * Persistent copy of cart ROMs in the onboard QSPI flash, enabled with -DDRMDMP_FLASH_CACHE=ON.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Start of the cache region in flash, everything below is left to the firmware image.
+#ifndef FLASHCACHE_OFFSET
+#define FLASHCACHE_OFFSET (1024 * 1024)
+#endif
+
+// WeAct boards come with 2 to 16MB, set with -DDRMDMP_FLASH_SIZE_MB=.
+#ifndef FLASHCACHE_FLASH_SIZE
+#define FLASHCACHE_FLASH_SIZE (PICO_FLASH_SIZE_BYTES)
+#endif
+
+// Number of carts the index keeps track of.
+#define FLASHCACHE_CARTS (16)
+
+void flashcache_init(void);
+bool flashcache_read_block(uint32_t address, uint32_t *buffer);
+bool flashcache_mirror_step(void);
+
+extern bool gFlashCacheAttached;
+extern uint32_t gFlashCacheHits;
+extern uint32_t gFlashCacheStored;
@@ -15,36 +15,59 @@
 //0x05    Write EEPROM  N64 Cartridge    10	      1
 
 #include <stdlib.h>
+#include <string.h>
 #include "pico/stdlib.h"
 
 #include "pico/platform.h"
 #include "hardware/gpio.h"
 #include "hardware/pio.h"
-#include "generated/joybus.pio.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "joybus.pio.h"
 #include "joybus.h"
+#include "joybusframe.h"
+#include "timing.h"
+#include "n64cartinterface.h"
+
+// The joybus program counts in 40ns PIO cycles.
+#define JOYBUS_PIO_HZ (25000000)
+
+// A transaction without a complete response by then is retried. The longest one, a block write, takes ~400us.
+#define JOYBUS_TIMEOUT_US (1500)
+#define JOYBUS_RETRIES    (10)
+
+// Idle time on the line between back to back transactions, covers the cart's stop bit.
+#define JOYBUS_GAP_US     (20)
+
+// The polled fallback keeps the gap the reads always had before the engine.
+#define JOYBUS_POLLED_GAP_US (200)
+
+// A write cycle takes up to 15ms, the info command reports it in its status byte.
+#define EEPROM_STATUS_BUSY      (0x80)
+#define EEPROM_POLL_US          (500)
+#define EEPROM_WRITE_TIMEOUT_US (50 * 1000)
 
 uint32_t ReadCount = 0;
 uint32_t gEepromSize = 0;
-
-void __time_critical_func(convertToPio)(const uint8_t* command, const int len, uint32_t* result, int* resultLen) {
-    if (len == 0) {
-        *resultLen = 0;
-        return;
-    }
-    *resultLen = len/2 + 1;
-    int i;
-    for (i = 0; i < *resultLen; i++) {
-        result[i] = 0;
-    }
-    for (i = 0; i < len; i++) {
-        for (int j = 0; j < 8; j++) {
-            result[i / 2] += (uint32_t)(1 << (2 * (8 * (i % 2) + j) + 1));
-            result[i / 2] += (uint32_t)((!!(command[i] & (0x80u >> j))) << (2 * (8 * (i % 2) + j)));
-        }
-    }
-    // End bit
-    result[len / 2] += 3 << (2 * (8 * (len % 2)));
-}
+uint32_t gEepromBlocksWritten = 0;
+uint32_t gEepromWriteUs = 0;
+uint32_t gEepromWriteErrors = 0;
+
+// Copy of the whole EEPROM, read once at init. Host reads never touch the joybus, host writes update the shadow
+// and mark the changed 8 byte blocks dirty for core1 to write back.
+static uint8_t EepromShadow[EEPROM_MAX_SIZE];
+static uint32_t DirtyBlocks[EEPROM_BLOCKS / 32];
+static volatile uint32_t DirtyCount = 0;
+static spin_lock_t *EepromLock;
+
+// Write-back in progress. Block is the one the chip is busy writing, its status is polled from NextPollUs on.
+static bool WriteBack = false;
+static uint32_t WriteBackStartUs;
+static bool BlockBusy = false;
+static uint32_t BlockStartUs;
+static uint32_t NextPollUs;
 
 PIO pio = pio0;
 PIO pio_1 = pio1;
@@ -55,42 +78,235 @@ void __time_critical_func(InitEepromClock)(uint clockpin)
 
     pio_gpio_init(pio_1, clockpin);
 
-    uint offset_1 = pio_add_program(pio_1, &joybus_program);
-    pio_sm_config config1 = joybus_program_get_default_config(offset_1);
+    // The clock generator has its own program, the rest of pio1 is used by the cart bus engine.
+    pio_sm_claim(pio_1, 1);
+    uint offset_1 = pio_add_program(pio_1, &joybus_clock_program);
+    pio_sm_config config1 = joybus_clock_program_get_default_config(offset_1);
     //sm_config_set_out_pins(&config1, clockpin, 1);
     sm_config_set_set_pins(&config1, clockpin, 1);
-    sm_config_set_clkdiv(&config1, 5);
+    sm_config_set_clkdiv(&config1, timing_pio_clkdiv(JOYBUS_PIO_HZ));
     //sm_config_set_out_shift(&config1, true, false, 32);
     //sm_config_set_in_shift(&config1, false, true, 8);
     
-    pio_sm_init(pio_1, 1, offset_1 + joybus_offset_clockgen, &config1);
+    pio_sm_init(pio_1, 1, offset_1 + joybus_clock_offset_clockgen, &config1);
     pio_sm_set_enabled(pio_1, 1, true);
 }
 
-uint32_t GetInputWithTimeout(void)
+pio_sm_config config;
+uint piooffset;
+
+#ifdef DRMDMP_JOYBUS_POLLED
+// Polled transactions, the way the joybus worked before the engine: the state machine is initialized again for every
+// transaction, the CPU pushes the frame and spins on the RX FIFO. A fallback for carts the engine misbehaves on,
+// enabled with -DDRMDMP_JOYBUS_POLLED=ON.
+static bool JoybusTransaction(const uint32_t *frame, uint words, uint8_t *response, uint32_t responseLength)
 {
-    uint32_t lastWriteTime = time_us_32();
-    while (1) {
-        if(pio_sm_is_rx_fifo_empty(pio, 0)) {
-            uint32_t now = time_us_32();
-            uint32_t diff = now - lastWriteTime;
+    pio_sm_set_enabled(pio, 0, false);
+    pio_sm_init(pio, 0, piooffset + joybus_offset_outmode, &config);
+    pio_sm_set_enabled(pio, 0, true);
+    for (uint i = 0; i < words; i += 1) {
+        pio_sm_put_blocking(pio, 0, frame[i]);
+    }
 
-            // Send the eeprom data if it's been ?Seconds since the last eeprom write
-            // Reset the lastWriteTime to 0 and don't sent the data unless we get another write
-            if (lastWriteTime != 0 && diff > 1000) {
-                lastWriteTime = 0;
-                break;
+    for (uint32_t i = 0; i < responseLength; i += 1) {
+        uint32_t Start = time_us_32();
+        while (pio_sm_is_rx_fifo_empty(pio, 0) != false) {
+            if ((time_us_32() - Start) > JOYBUS_TIMEOUT_US) {
+                return false;
             }
+        }
+
+        response[i] = (uint8_t)pio_sm_get(pio, 0);
+    }
+
+    return true;
+}
+
+// Same streams as the engine runs, one transaction at a time with the old gap between them.
+static bool JoybusRun(const uint32_t *frame, uint words, uint32_t block, uint8_t *response,
+                      uint32_t responseLength, uint32_t count, uint32_t retries)
+{
+    uint32_t Frame[8];
+    memcpy(Frame, frame, words * 4);
+    for (uint32_t i = 0; i < count; i += 1) {
+        if (i != 0) {
+            sleep_us(JOYBUS_POLLED_GAP_US);
+            Frame[0] = JoybusPatchBlock(Frame[0], block + i);
+        }
+
+        uint32_t Tries = 0;
+        while (JoybusTransaction(Frame, words, &response[i * responseLength], responseLength) == false) {
+            Tries += 1;
+            if (Tries > retries) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+#else
+// Transaction engine. A stream is count transactions of the same frame, the byte after the command byte (the
+// block number) goes up by one per transaction and each response lands right after the previous one.
+// The encoded frame goes out by DMA, the RX FIFO interrupt collects the response and a hardware alarm either
+// starts the next transaction after a short bus gap or retries one the cart did not answer in time.
+static uint JoybusDma;
+static dma_channel_config JoybusDmaConfig;
+static uint JoybusAlarm;
+static uint JoybusCore;
+static uint32_t TxFrame[8];
+static uint TxWords;
+
+static uint32_t StreamBlock;
+static uint8_t *StreamResponse;
+static uint32_t StreamResponseLength;
+static uint32_t StreamRemaining;
+static uint32_t StreamReceived;
+static uint32_t StreamRetries;
+static uint32_t StreamRetryLimit;
+static volatile bool StreamWaiting = false;
+static volatile bool StreamGap = false;
+static volatile bool StreamDone = true;
+static volatile bool StreamFailed = false;
+static absolute_time_t AlarmTarget;
+
+static void JoybusAlarmIrq(uint alarm);
+
+static void __time_critical_func(JoybusArmTarget)(void)
+{
+    if (hardware_alarm_set_target(JoybusAlarm, AlarmTarget) != false) {
+        // Already in the past, the alarm will not fire.
+        JoybusAlarmIrq(JoybusAlarm);
+    }
+}
+
+static void __time_critical_func(JoybusArm)(uint32_t us)
+{
+    AlarmTarget = make_timeout_time_us(us);
+    JoybusArmTarget();
+}
+
+static void __time_critical_func(JoybusStart)(void)
+{
+    StreamReceived = 0;
+    StreamWaiting = true;
+
+    // Drop what is left of the last response (the stop bit) and jump straight to the out mode.
+    pio_sm_clear_fifos(pio, 0);
+    pio_sm_restart(pio, 0);
+    pio_sm_exec(pio, 0, pio_encode_jmp(piooffset + joybus_offset_outmode));
+    dma_channel_configure(JoybusDma, &JoybusDmaConfig, &pio->txf[0], TxFrame, TxWords, true);
+    JoybusArm(JOYBUS_TIMEOUT_US);
+}
+
+static void __time_critical_func(JoybusFinish)(bool failed)
+{
+    StreamWaiting = false;
+    StreamFailed = failed;
+    __dmb();
+    StreamDone = true;
+    __sev();
+}
+
+static void __time_critical_func(JoybusRxIrq)(void)
+{
+    while (pio_sm_is_rx_fifo_empty(pio, 0) == false) {
+        uint8_t Data = (uint8_t)pio_sm_get(pio, 0);
+        if ((StreamWaiting != false) && (StreamReceived < StreamResponseLength)) {
+            StreamResponse[StreamReceived] = Data;
+            StreamReceived += 1;
+        }
+    }
+
+    if ((StreamWaiting == false) || (StreamReceived < StreamResponseLength)) {
+        return;
+    }
+
+    StreamWaiting = false;
+    hardware_alarm_cancel(JoybusAlarm);
+    StreamRemaining -= 1;
+    if (StreamRemaining == 0) {
+        JoybusFinish(false);
+        return;
+    }
+
+    StreamBlock += 1;
+    TxFrame[0] = JoybusPatchBlock(TxFrame[0], StreamBlock);
+    StreamResponse += StreamResponseLength;
+    StreamRetries = 0;
+    StreamGap = true;
+    JoybusArm(JOYBUS_GAP_US);
+}
+
+static void __time_critical_func(JoybusAlarmIrq)(uint alarm)
+{
+    (void)alarm;
+    // The alarm can already be pending when JoybusRxIrq cancels it and arms the gap, that stale callback must not
+    // start the next transaction early. The SDK dropped the new target with it, so arm it again.
+    if (absolute_time_diff_us(get_absolute_time(), AlarmTarget) > 0) {
+        JoybusArmTarget();
+        return;
+    }
+
+    if (StreamGap != false) {
+        StreamGap = false;
+        JoybusStart();
+    } else if (StreamWaiting != false) {
+        // No (complete) response in time.
+        StreamWaiting = false;
+        StreamRetries += 1;
+        if (StreamRetries > StreamRetryLimit) {
+            JoybusFinish(true);
         } else {
-            return pio_sm_get(pio, 0);
+            JoybusStart();
         }
     }
+}
 
-    return 0xFFFFFFFF;
+static void JoybusInitEngine(void)
+{
+    JoybusDma = (uint)dma_claim_unused_channel(true);
+    JoybusDmaConfig = dma_channel_get_default_config(JoybusDma);
+    channel_config_set_transfer_data_size(&JoybusDmaConfig, DMA_SIZE_32);
+    channel_config_set_read_increment(&JoybusDmaConfig, true);
+    channel_config_set_write_increment(&JoybusDmaConfig, false);
+    channel_config_set_dreq(&JoybusDmaConfig, pio_get_dreq(pio, 0, true));
+
+    // The interrupts belong to the core calling InitEeprom, core1 from cartio_init. Every stream has to run on
+    // that core: the init reads and the write-back steps do, core0 only ever touches the shadow.
+    JoybusCore = get_core_num();
+    JoybusAlarm = (uint)hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(JoybusAlarm, JoybusAlarmIrq);
+    pio_set_irq0_source_enabled(pio, pis_sm0_rx_fifo_not_empty, true);
+    irq_set_exclusive_handler(PIO0_IRQ_0, JoybusRxIrq);
+    irq_set_enabled(PIO0_IRQ_0, true);
 }
 
-pio_sm_config config;
-uint piooffset;
+// Run a stream of count transactions and wait for it on the engine's core, returns false when the cart stopped
+// answering.
+static bool JoybusRun(const uint32_t *frame, uint words, uint32_t block, uint8_t *response,
+                      uint32_t responseLength, uint32_t count, uint32_t retries)
+{
+    assert(get_core_num() == JoybusCore);
+    memcpy(TxFrame, frame, words * 4);
+    TxWords = words;
+    StreamBlock = block;
+    StreamResponse = response;
+    StreamResponseLength = responseLength;
+    StreamRemaining = count;
+    StreamRetries = 0;
+    StreamRetryLimit = retries;
+    StreamFailed = false;
+    StreamDone = false;
+    JoybusStart();
+    while (StreamDone == false) {
+        __wfe();
+    }
+
+    return StreamFailed == false;
+}
+#endif
+
 void __time_critical_func(InitEeprom)(uint dataPin)
 {
     gpio_init(dataPin);
@@ -106,34 +322,19 @@ void __time_critical_func(InitEeprom)(uint dataPin)
     sm_config_set_in_pins(&config, dataPin);
     sm_config_set_out_pins(&config, dataPin, 1);
     sm_config_set_set_pins(&config, dataPin, 1);
-    sm_config_set_clkdiv(&config, 5);
+    sm_config_set_clkdiv(&config, timing_pio_clkdiv(JOYBUS_PIO_HZ));
     sm_config_set_out_shift(&config, true, false, 32);
     sm_config_set_in_shift(&config, false, true, 8);
 
     pio_sm_init(pio, 0, piooffset, &config);
     pio_sm_set_enabled(pio, 0, true);
+#ifndef DRMDMP_JOYBUS_POLLED
+    JoybusInitEngine();
+#endif
 
-    // Send the info command
-    {
-        uint8_t probeResponse[1] = {0x00};
-        uint32_t result[8];
-        int resultLen;
-        convertToPio(probeResponse, 1, result, &resultLen);
-
-        pio_sm_set_enabled(pio, 0, false);
-        pio_sm_init(pio, 0, piooffset + joybus_offset_outmode, &config);
-        pio_sm_set_enabled(pio, 0, true);
-
-        for (int i = 0; i < resultLen; i++) pio_sm_put_blocking(pio, 0, result[i]);
-    }
-
-    // Check response
-    uint32_t buffer[3];
-    buffer[0] = GetInputWithTimeout();
-    if (buffer[0] == 0) {
-        buffer[1] = pio_sm_get_blocking(pio, 0);
-        buffer[2] = pio_sm_get_blocking(pio, 0);
-
+    // Send the info command, a cart without EEPROM never answers so there is no retry.
+    uint8_t buffer[3];
+    if (JoybusRun(InfoTemplate, 1, 0, buffer, 3, 1, 0) != false) {
         // Determine the size of the EEPROM.
         if (buffer[1] == 0x80) {
             // 4K Eeprom.
@@ -151,86 +352,168 @@ void __time_critical_func(InitEeprom)(uint dataPin)
     }
 }
 
-void __time_critical_func(ReadEepromData)(uint32_t offset, uint8_t *buffer) 
+// Read count 8 byte blocks as one back to back stream.
+bool __time_critical_func(ReadEepromData)(uint32_t block, uint8_t *buffer, uint32_t count)
 {
     if (gEepromSize == 0) {
+        return false;
+    }
+
+    uint32_t Frame[2] = { JoybusPatchBlock(ReadTemplate[0], block), ReadTemplate[1] };
+    if (JoybusRun(Frame, 2, block, buffer, 8, count, JOYBUS_RETRIES) == false) {
+        gEepromSize = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// Send one 8 byte block, the chip is busy with its write cycle afterwards.
+static bool WriteEepromBlock(uint32_t block, const uint8_t *data)
+{
+    uint32_t Frame[6];
+    JoybusBuildWrite(block, data, Frame);
+
+    uint8_t response[1];
+    return JoybusRun(Frame, 6, block, response, 1, 1, JOYBUS_RETRIES);
+}
+
+// Read the whole EEPROM into the shadow, called once by cartio_init after InitEeprom.
+void LoadEepromShadow(void)
+{
+    EepromLock = spin_lock_init((uint)spin_lock_claim_unused(true));
+    ReadEepromData(0, EepromShadow, ReadCount);
+}
+
+// One 512 byte sector of the EEPROM image, address is the byte offset. Past the end of the EEPROM reads zeros.
+void ReadEepromShadow(uint32_t address, uint8_t *buffer, bool flip)
+{
+    if (address >= gEepromSize) {
+        memset(buffer, 0, EEPROM_SECTOR_SIZE);
         return;
     }
 
-    // Read the eeprom.
-    for (uint32_t ReadIndex = 0; ReadIndex < 64; ReadIndex += 1) {
-        // Construct the read command.
-        uint8_t probeResponse[] = {0x04, (uint8_t)(ReadIndex + offset)};
-        uint32_t result[8];
-        int resultLen;
-        convertToPio(probeResponse, 2, result, &resultLen);
-
-        uint32_t firstInput;
-        uint32_t retries = 0;
-        do {
-            // Send the read command
-            pio_sm_set_enabled(pio, 0, false);
-            pio_sm_init(pio, 0, piooffset + joybus_offset_outmode, &config);
-            pio_sm_set_enabled(pio, 0, true);
-
-            for (int i = 0; i < resultLen; i++) pio_sm_put_blocking(pio, 0, result[i]);
-
-            firstInput = GetInputWithTimeout();
-            if (retries > 10) {
-                gEepromSize = 0;
-                return;
-            }
-            retries += 1;
+    uint32_t Irq = spin_lock_blocking(EepromLock);
+    memcpy(buffer, &EepromShadow[address], EEPROM_SECTOR_SIZE);
+    spin_unlock(EepromLock, Irq);
+    if (flip != false) {
+        flip16_buffer((uint16_t*)buffer, EEPROM_SECTOR_SIZE);
+    }
+}
 
-        } while (firstInput == 0xFFFFFFFF);
-        // Read the incoming data from the cart.
-        buffer[(uint)ReadIndex * 8] = (uint8_t)firstInput;
-        for (int i = 1; i < 8; i += 1) {
-            buffer[(uint)i + (uint)ReadIndex * 8] = (uint8_t)pio_sm_get_blocking(pio, 0);
+// Only the 8 byte blocks that differ from the shadow are written back, a write cycle is slow and wears the EEPROM.
+// Core0 only updates the shadow here, core1 writes the dirty blocks back through StepEepromWriteBack.
+void WriteEepromShadow(uint32_t address, const uint8_t *buffer, bool flip)
+{
+    if (address >= gEepromSize) {
+        return;
+    }
+
+    uint8_t Sector[EEPROM_SECTOR_SIZE];
+    memcpy(Sector, buffer, sizeof(Sector));
+    if (flip != false) {
+        flip16_buffer((uint16_t*)Sector, sizeof(Sector));
+    }
+
+    uint32_t Irq = spin_lock_blocking(EepromLock);
+    for (uint32_t i = 0; i < EEPROM_SECTOR_SIZE; i += 8) {
+        if (memcmp(&EepromShadow[address + i], &Sector[i], 8) == 0) {
+            continue;
+        }
+
+        uint32_t Block = (address + i) / 8;
+        memcpy(&EepromShadow[address + i], &Sector[i], 8);
+        if ((DirtyBlocks[Block / 32] & (1u << (Block % 32))) == 0) {
+            DirtyBlocks[Block / 32] |= (1u << (Block % 32));
+            DirtyCount += 1;
         }
-        sleep_us(200);
     }
+
+    spin_unlock(EepromLock, Irq);
 }
 
-void __time_critical_func(WriteEepromData)(uint32_t offset, uint8_t *buffer)
+// Check whether the chip finished the write cycle of the last block, returns false while it is still busy.
+static bool EepromPoll(void)
 {
-    // Write the eeprom.
-    for (uint32_t WriteIndex = 0; WriteIndex < 64; WriteIndex += 1) {
-        // Construct the write command.
-        uint8_t probeResponse[10] = {0x05, (uint8_t)(WriteIndex + offset)};
-        for (uint i = 0; i < 8; i += 1) {
-            probeResponse[i + 2] = buffer[i + (WriteIndex * 8)];
-        }
+    uint32_t Now = time_us_32();
+    if ((int32_t)(Now - NextPollUs) < 0) {
+        return false;
+    }
 
-        uint32_t result[10];
-        int resultLen;
-        convertToPio(probeResponse, 10, result, &resultLen);
+    uint8_t response[3];
+    bool Answered = JoybusRun(InfoTemplate, 1, 0, response, 3, 1, JOYBUS_RETRIES);
+    if ((Answered != false) && ((response[2] & EEPROM_STATUS_BUSY) != 0) &&
+        ((Now - BlockStartUs) < EEPROM_WRITE_TIMEOUT_US)) {
+        NextPollUs = Now + EEPROM_POLL_US;
+        return false;
+    }
 
-        uint32_t firstInput;
-        uint32_t retries = 0;
-        do {
-            // Send the read command
-            pio_sm_set_enabled(pio, 0, false);
-            pio_sm_init(pio, 0, piooffset + joybus_offset_outmode, &config);
-            pio_sm_set_enabled(pio, 0, true);
+    BlockBusy = false;
+    if ((Answered == false) || ((response[2] & EEPROM_STATUS_BUSY) != 0)) {
+        gEepromWriteErrors += 1;
+    } else {
+        gEepromBlocksWritten += 1;
+    }
 
-            for (int i = 0; i < resultLen; i++) pio_sm_put_blocking(pio, 0, result[i]);
+    return true;
+}
 
-            firstInput = GetInputWithTimeout();
-            if (retries > 10) {
-                gEepromSize = 0;
-                return;
-            }
-            retries += 1;
-
-        } while (firstInput == 0xFFFFFFFF);
-        // Read the incoming data from the cart.
-        uint8_t response[2];
-        response[0] = (uint8_t)firstInput;
-        if (response[0] != 0) {
-            sleep_ms(10);
+// Advance the EEPROM write-back by one block, called by core1 whenever it has nothing else to do. Returns false
+// while there is nothing to do, including while the chip is busy with a write cycle.
+bool StepEepromWriteBack(void)
+{
+    if (BlockBusy != false) {
+        return EepromPoll();
+    }
+
+    if (DirtyCount == 0) {
+        if (WriteBack != false) {
+            WriteBack = false;
+            gEepromWriteUs = time_us_32() - WriteBackStartUs;
         }
 
-        sleep_us(200);
+        return false;
+    }
+
+    if (WriteBack == false) {
+        WriteBack = true;
+        WriteBackStartUs = time_us_32();
+        gEepromBlocksWritten = 0;
+        gEepromWriteUs = 0;
+        gEepromWriteErrors = 0;
+    }
+
+    // The block is copied right before it goes out, a host write racing it marks the block dirty again.
+    uint8_t Data[8];
+    uint32_t Irq = spin_lock_blocking(EepromLock);
+    uint32_t Block = 0;
+    while ((DirtyBlocks[Block / 32] & (1u << (Block % 32))) == 0) {
+        Block += 1;
+    }
+
+    DirtyBlocks[Block / 32] &= ~(1u << (Block % 32));
+    DirtyCount -= 1;
+    memcpy(Data, &EepromShadow[Block * 8], sizeof(Data));
+    spin_unlock(EepromLock, Irq);
+
+    if (WriteEepromBlock(Block, Data) == false) {
+        gEepromWriteErrors += 1;
+        return true;
     }
-}
\ No newline at end of file
+
+    BlockBusy = true;
+    BlockStartUs = time_us_32();
+    NextPollUs = BlockStartUs + EEPROM_POLL_US;
+    return true;
+}
+
+// How long core1 may sleep before the next status poll is due, EEPROM_NO_POLL without a write cycle running.
+uint32_t EepromPollUs(void)
+{
+    if (BlockBusy == false) {
+        return EEPROM_NO_POLL;
+    }
+
+    int32_t Remaining = (int32_t)(NextPollUs - time_us_32());
+    return (Remaining > 0) ? (uint32_t)Remaining : 0;
+}
@@ -7,9 +7,24 @@
  */
 
 #pragma once
+
+#define EEPROM_MAX_SIZE    (2048)
+#define EEPROM_SECTOR_SIZE (512)
+#define EEPROM_BLOCKS      (EEPROM_MAX_SIZE / 8)
+#define EEPROM_NO_POLL     (0xFFFFFFFF)
+
 void InitEeprom(uint dataPin);
 void InitEepromClock(uint clockpin);
-void ReadEepromData(uint32_t offset, uint8_t *buffer);
-void WriteEepromData(uint32_t offset, uint8_t *buffer);
+bool ReadEepromData(uint32_t block, uint8_t *buffer, uint32_t count);
+void LoadEepromShadow(void);
+void ReadEepromShadow(uint32_t address, uint8_t *buffer, bool flip);
+void WriteEepromShadow(uint32_t address, const uint8_t *buffer, bool flip);
+bool StepEepromWriteBack(void);
+uint32_t EepromPollUs(void);
+
+extern uint32_t gEepromSize;
 
-extern uint32_t gEepromSize;
\ No newline at end of file
+// Statistics of the last write-back, the time runs from the first dirty block to the last write cycle.
+extern uint32_t gEepromBlocksWritten;
+extern uint32_t gEepromWriteUs;
+extern uint32_t gEepromWriteErrors;
\ No newline at end of file
@@ -0,0 +1,53 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * JoybusFrame
+ * Encoding of joybus frames for the TX FIFO of the joybus program, shared with the host tests.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Each bit goes out as a (value, valid) pair, MSB first, so one byte becomes 16 bits of a TX word.
+#define JOYBUS_BIT(b, j)   ((((uint32_t)(b) >> (7 - (j))) & 1u) << (2 * (j)) | (2u << (2 * (j))))
+#define JOYBUS_ENC(b)      (JOYBUS_BIT(b, 0) | JOYBUS_BIT(b, 1) | JOYBUS_BIT(b, 2) | JOYBUS_BIT(b, 3) | \
+                            JOYBUS_BIT(b, 4) | JOYBUS_BIT(b, 5) | JOYBUS_BIT(b, 6) | JOYBUS_BIT(b, 7))
+#define JOYBUS_ENC4(b)     JOYBUS_ENC(b), JOYBUS_ENC((b) + 1), JOYBUS_ENC((b) + 2), JOYBUS_ENC((b) + 3)
+#define JOYBUS_ENC16(b)    JOYBUS_ENC4(b), JOYBUS_ENC4((b) + 4), JOYBUS_ENC4((b) + 8), JOYBUS_ENC4((b) + 12)
+#define JOYBUS_ENC64(b)    JOYBUS_ENC16(b), JOYBUS_ENC16((b) + 16), JOYBUS_ENC16((b) + 32), JOYBUS_ENC16((b) + 48)
+
+// The stop bit, a valid 1. The pair after it is left invalid, which sends the program back to the in mode.
+#define JOYBUS_STOP        (3u)
+
+static const uint16_t JoybusByteTable[256] = {
+    JOYBUS_ENC64(0), JOYBUS_ENC64(64), JOYBUS_ENC64(128), JOYBUS_ENC64(192)
+};
+
+// Prebuilt frames, a read or write only patches in the block number (high half of word 0) and the payload.
+static const uint32_t InfoTemplate[1] = { JOYBUS_ENC(0x00) | (JOYBUS_STOP << 16) };
+static const uint32_t ReadTemplate[2] = { JOYBUS_ENC(0x04), JOYBUS_STOP };
+static const uint32_t WriteTemplate[6] = { JOYBUS_ENC(0x05), 0, 0, 0, 0, JOYBUS_STOP };
+
+static inline uint32_t JoybusPatchBlock(uint32_t word, uint32_t block)
+{
+    return (word & 0xFFFF) | ((uint32_t)JoybusByteTable[block & 0xFF] << 16);
+}
+
+// Two bytes of a frame in one TX word, the first one goes out first.
+static inline uint32_t JoybusEncodePair(uint8_t first, uint8_t second)
+{
+    return JoybusByteTable[first] | ((uint32_t)JoybusByteTable[second] << 16);
+}
+
+// Write frame of one 8 byte block: the template with the block number and the payload patched in.
+static inline void JoybusBuildWrite(uint32_t block, const uint8_t *data, uint32_t *frame)
+{
+    frame[0] = JoybusPatchBlock(WriteTemplate[0], block);
+    for (uint32_t i = 0; i < 4; i += 1) {
+        frame[i + 1] = JoybusEncodePair(data[i * 2], data[(i * 2) + 1]);
+    }
+
+    frame[5] = WriteTemplate[5];
+}
@@ -8,8 +8,15 @@
 #include <string.h>
 
 #include "bsp/board.h"
+#include "pico/multicore.h"
 #include "tusb.h"
 #include "n64cartinterface.h"
+#include "timing.h"
+#include "romcache.h"
+#include "prefetch.h"
+#include "flashcache.h"
+#include "romhash.h"
+#include "savecache.h"
 
 //--------------------------------------------------------------------+
 // MACRO CONSTANT TYPEDEF PROTYPES
@@ -19,11 +26,13 @@
  * - 250 ms  : device not mounted
  * - 1000 ms : device mounted
  * - 2500 ms : device is suspended
+ * - 100 ms  : no cart header, core1 gave up
  */
 enum  {
   BLINK_NOT_MOUNTED = 250,
   BLINK_MOUNTED = 1000,
   BLINK_SUSPENDED = 2500,
+  BLINK_NO_CART = 100,
 };
 
 static uint32_t blink_interval_ms = BLINK_NOT_MOUNTED;
@@ -31,13 +40,35 @@ static uint32_t blink_interval_ms = BLINK_NOT_MOUNTED;
 void led_blinking_task(void);
 void cdc_task(void);
 
+// Core1 probes the cart while core0 already serves USB, then stays on as the prefetcher.
+static void core1_main(void)
+{
+  cartio_init();
+  savecache_init();
+  flashcache_init();
+  timing_boot_phase(BOOT_PHASE_READY);
+  cartio_set_ready();
+  prefetch_run();
+}
+
 /*------------- MAIN -------------*/
 int main(void)
 {
+  // Set the system clock before anything derives timings from it.
+  timing_init();
   board_init();
-  cartio_init();
+
   // init device stack on configured roothub port
+  // USB comes up right away, the host enumerates while core1 probes the cart. The disk reports
+  // "becoming ready" until the probe is done, see tud_msc_test_unit_ready_cb.
   tud_init(BOARD_TUD_RHPORT);
+  timing_boot_phase(BOOT_PHASE_USB);
+
+  romcache_init();
+  romhash_init();
+  // Core1 locks core0 out while it writes the flash cache.
+  multicore_lockout_victim_init();
+  multicore_launch_core1(core1_main);
 
   while (1)
   {
@@ -55,6 +86,10 @@ int main(void)
 // Invoked when device is mounted
 void tud_mount_cb(void)
 {
+  if (gBootPhaseUs[BOOT_PHASE_MOUNTED] == 0) {
+    timing_boot_phase(BOOT_PHASE_MOUNTED);
+  }
+
   blink_interval_ms = BLINK_MOUNTED;
 }
 
@@ -137,9 +172,12 @@ void led_blinking_task(void)
   static uint32_t start_ms = 0;
   static bool led_state = false;
 
+  // Core0 owns the LED, core1 only reports a missing cart.
+  uint32_t interval_ms = gCartMissing ? BLINK_NO_CART : blink_interval_ms;
+
   // Blink every interval ms
-  if ( board_millis() - start_ms < blink_interval_ms) return; // not enough time
-  start_ms += blink_interval_ms;
+  if ( board_millis() - start_ms < interval_ms) return; // not enough time
+  start_ms += interval_ms;
 
   board_led_write(led_state);
   led_state = 1 - led_state; // toggle
@@ -12,15 +12,22 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include "pico/stdlib.h"
+#include "hardware/sync.h"
 #include "n64cartinterface.h"
 #include "joybus.h"
+#include "cartbus.h"
+#include "timing.h"
+#include "romsize.h"
 
-#define LATCH_DELAY_US 1
-#define LATCH_DELAY_NS (110 / 14)
+#define LATCH_DELAY_NS (56)
 
-#define CART_ADDRESS_START (0x10000000)
-#define SRAM_ADDRESS_START (0x08000000)
-uint32_t readarr[32768];
+// Boot waits. COLD_RESET is held low briefly, then the header is polled for instead of sleeping a fixed time.
+#define BOOT_RESET_HOLD_MS      (10)
+#define BOOT_HEADER_TIMEOUT_MS  (100)
+#define BOOT_REMAP_TIMEOUT_MS   (300)
+
+// Init time scratch, large enough for the header and boot code. The ROM cache took over the rest of the old 128KB.
+uint32_t readarr[1024];
 
 #define CRC_NUS_5101 0x587BD543 // ??
 #define CRC_NUS_6101 0x9AF30466 //0x6170A4A1
@@ -37,9 +44,12 @@ uint32_t readarr[32768];
 
 uint32_t address_pin_mask = 0;
 static char gpio_is_output = 0;
-uint32_t gRomSize = 64 * 1024 * 1024;
+uint32_t gRomSize = ROMSIZE_MAX;
+uint32_t gRomSizeProbeUs = 0;
 uint32_t gFramPresent = 0;
 uint32_t gSRAMPresent = 1;
+uint32_t gSRAMSize = SRAM_SIZE;
+bool gSRAMBanked = false;
 uint8_t gFlashType = 0;
 uint32_t gCICType = 0xFF;
 uint16_t gGameTitle[0x16];
@@ -47,6 +57,12 @@ uint16_t gGameCode[6];
 uint32_t gChecksum;
 const char* gCICName;
 bool gGpioRemap = false;
+volatile bool gCartReady = false;
+volatile bool gCartMissing = false;
+
+// Bit-banged bus delays in system clock cycles, derived from the running clock in cartio_init.
+static uint32_t LatchDelayCycles = 7;
+static uint32_t ReadLowDelayCycles = 33;
 
 void set_ad_input() {
     for(uint32_t i = 0; i < 16; i++) {
@@ -66,64 +82,35 @@ void set_ad_output() {
     gpio_is_output = 1;
 }
 
-uint32_t CrcTable[256];
-bool TableBuilt = false;
-uint32_t si_crc32(const uint8_t *data, size_t size) {
-    unsigned n, k;
-    uint32_t c;
-
-    // No need to recompute the table on every invocation.
-    if (TableBuilt == false) {
-        for (n = 0; n < 256; n++) {
-            c = (uint32_t) n;
-            for (k = 0; k < 8; k++) {
-                if (c & 1) {
-                    c = 0xEDB88320L ^ (c >> 1);
-                    
-                } else {
-                    c = c >> 1;
-                }
-
-                CrcTable[n] = c;
-            }
+// Latch the ROM start until the cart answers with the header magic or the timeout runs out.
+static uint32_t cartio_wait_header(uint32_t timeout_ms)
+{
+    absolute_time_t Timeout = make_timeout_time_ms(timeout_ms);
+    uint32_t read;
+    do {
+        set_address(CART_ADDRESS_START);
+        read = (((uint32_t)read16()) << 16) | (read16());
+        if (read == 0x80371240) {
+            break;
         }
 
-        TableBuilt = true;
-    }
+        sleep_us(100);
+    } while (absolute_time_diff_us(get_absolute_time(), Timeout) > 0);
 
-    c = 0L ^ 0xFFFFFFFF;
-    for (n = 0; n < size; n++) {
-        c = CrcTable[(c ^ data[n]) & 0xFF] ^ (c >> 8);
-    }
-
-  return c ^ 0xFFFFFFFF;
+    return read;
 }
 
 void cartio_init()
 {
-    // Setup the LED pin
-    gpio_init(PICO_DEFAULT_LED_PIN);
-    gpio_set_dir(PICO_DEFAULT_LED_PIN, GPIO_OUT);
-    gpio_put(PICO_DEFAULT_LED_PIN, true);
+    LatchDelayCycles = timing_ns_to_cycles(LATCH_DELAY_NS);
+    ReadLowDelayCycles = timing_ns_to_cycles(READ_LOW_DELAY_NS);
 
     // Roms do not read until COLD_RESET is pulled hi, atleast on the NUS3 carts with battery backed SRAM.
     gpio_init(N64_COLD_RESET);
     gpio_set_dir(N64_COLD_RESET, true);
     gpio_put(N64_COLD_RESET, false); 
 
-    // Indicate the initialization process through the onboard led.
-    volatile int t = 0;
-    while(t < 5) {
-        gpio_put(PICO_DEFAULT_LED_PIN, true);
-        sleep_ms(100);
-        gpio_put(PICO_DEFAULT_LED_PIN, false);
-        sleep_ms(100);
-        t++;
-    }
-
-    gpio_put(PICO_DEFAULT_LED_PIN, true);
-    sleep_ms(50);
-
+    // The led stays on while the cart is initialized.
     // Setup data/address lines.
     for (uint32_t i = 0; i < 16; i++) {
         gpio_init(i);
@@ -159,9 +146,9 @@ void cartio_init()
     // Eeprom init.
     InitEepromClock(N64_EEPROM_CLK);
 
-    sleep_ms(300);
+    sleep_ms(BOOT_RESET_HOLD_MS);
     gpio_put(N64_COLD_RESET, true);
-    sleep_ms(100);
+    timing_boot_phase(BOOT_PHASE_RESET);
 
     gpio_init(N64_CIC_DCLK);
     gpio_set_dir(N64_CIC_DCLK, true);
@@ -173,8 +160,8 @@ void cartio_init()
     gpio_set_pulls(N64_CIC_DIO, true, false);
 
     // Read start address, assert that the retured value is something valid.
-    set_address(CART_ADDRESS_START);
-    uint32_t read = (((uint32_t)read16()) << 16) | (read16());
+    // The cart answers as soon as it is out of reset, so poll for the header instead of waiting it out.
+    uint32_t read = cartio_wait_header(BOOT_HEADER_TIMEOUT_MS);
     if (read != 0x80371240) {
         gGpioRemap = true;
         // Force setup.
@@ -182,49 +169,29 @@ void cartio_init()
         gpio_set_dir(N64_ALEL, true);
         gpio_put(N64_ALEL, false);
         gpio_set_pulls(N64_ALEL, true, false);
-        sleep_ms(300);
-        set_address(CART_ADDRESS_START);
-        read = (((uint32_t)read16()) << 16) | (read16());
+        read = cartio_wait_header(BOOT_REMAP_TIMEOUT_MS);
     }
 
     assert(read == 0x80371240);
 
-    // Hang is coudn't header.
-    while(read != 0x80371240) {
-        gpio_put(PICO_DEFAULT_LED_PIN, true);
-        sleep_ms(100);
-        gpio_put(PICO_DEFAULT_LED_PIN, false);
-        sleep_ms(100);
+    // Hang if the header couldn't be read, core0 owns the LED and blinks the error.
+    if (read != 0x80371240) {
+        gCartMissing = true;
+        while (1) {
+            sleep_ms(100);
+        }
     }
 
-    for (uint32_t x = 4; x < 64; x += 4) {
-        // Check if the data at 16MB is a repeat of start.
-        set_address(CART_ADDRESS_START + (x * 1024 * 1024));
-        uint32_t readcheck = (((uint32_t)read16()) << 16) | (read16());
-        // Check if the data at x is a repeat of start.
-        if (read == readcheck) {
-            gRomSize = x * 1024 * 1024;
-            break;
-        }
+    timing_boot_phase(BOOT_PHASE_HEADER);
 
-        // Check for an open bus. This means no hw is responding to the set address.
-        bool IsOpenBus = true;
-        for (uint32_t y = 0; y < 256; y += 1) {
-            set_address(CART_ADDRESS_START + (x * 1024 * 1024) + (y * 2));
-            uint32_t OpenBusValue = (uint16_t)(x * 1024 * 1024) + (y * 2);
-            OpenBusValue = OpenBusValue | (OpenBusValue << 16);
-            readcheck = (((uint32_t)read16()) << 16) | (read16());
-            if (readcheck != OpenBusValue) {
-                IsOpenBus = false;
-                break;
-            }
-        }
+    // The ALE pin mapping is known now, bulk reads can go through the PIO engine.
+    cartbus_init();
+    cartbus_calibrate();
+    timing_boot_phase(BOOT_PHASE_CALIBRATE);
 
-        if (IsOpenBus != false) {
-            gRomSize = x * 1024 * 1024;
-            break;
-        }
-    }
+    uint32_t ProbeStart = time_us_32();
+    gRomSize = romsize_probe(cart_read_burst);
+    gRomSizeProbeUs = time_us_32() - ProbeStart;
 
     // Check for FRAM presence. This write is okay on every cart
     // because it will always be outside of the 32K SRAM space and the 512 write space of an FRAM chip.
@@ -252,30 +219,21 @@ void cartio_init()
 
 
     // Check for an open bus. This means no hw is responding to the set address.
-    bool IsOpenBus = true;
-    for (uint32_t i = 0; i < 256; i += 1) {
-        set_address(SRAM_ADDRESS_START + (i * 2));
-        uint32_t OpenBusValue = (uint16_t)(SRAM_ADDRESS_START + (i * 2));
-        OpenBusValue = OpenBusValue | (OpenBusValue << 16);
-        uint32_t readcheck = (((uint32_t)read16()) << 16) | (read16());
-        if (readcheck != OpenBusValue) {
-            IsOpenBus = false;
-            break;
-        }
-    }
-
+    // One burst at the distinctive offset the ROM size probe uses, an erased SRAM reading back zeros is not mistaken
+    // for the low halfword of SRAM_ADDRESS_START.
+    uint32_t SramBlock[ROMSIZE_PROBE_SIZE / 4];
+    cart_read_burst(SRAM_ADDRESS_START + ROMSIZE_OPENBUS_OFFSET, (uint16_t*)SramBlock, sizeof(SramBlock));
+    bool IsOpenBus = romsize_is_open_bus(SramBlock, SRAM_ADDRESS_START + ROMSIZE_OPENBUS_OFFSET);
     if (IsOpenBus != false) {
         gSRAMPresent = false;
-        set_address(SRAM_ADDRESS_START);
-        for (uint i = 0; i < (sizeof(readarr) / 4); i += 1) {
-            readarr[i] = (((uint32_t)read16()) << 16) | (read16());
-        }
     }
 
+    timing_boot_phase(BOOT_PHASE_PROBE);
+
     // EEPROM init.
     InitEeprom(N64_EEPROM_DAT);
-    uint8_t Buffer[512];
-    ReadEepromData(0, Buffer);
+    LoadEepromShadow();
+    timing_boot_phase(BOOT_PHASE_EEPROM);
 
     // Do cart test and get cart data. Start with the CIC hello protocol.
     uint8_t CICHello = 0;
@@ -297,23 +255,23 @@ void cartio_init()
     }
 
     // Read the 0x1000 bytes to determine Rom name, Cart Id, Region and CIC hash.
-    set_address(CART_ADDRESS_START + 0x20);
+    uint16_t *header = (uint16_t*)readarr;
+    cart_read_burst(CART_ADDRESS_START, header, 0x1000);
     for (uint i = 0; i < (sizeof(gGameTitle) / 2); i += 1) {
-        gGameTitle[i] = flip16(read16());
+        gGameTitle[i] = flip16(header[(0x20 / 2) + i]);
     }
 
-    set_address(CART_ADDRESS_START + 0x3A);
     for (uint i = 0; i < (sizeof(gGameCode) / 2); i += 1) {
-        gGameCode[i] = read16();
+        gGameCode[i] = header[(0x3A / 2) + i];
     }
 
-    uint16_t buffer[0xFC0 / 2];
-    for (uint i = 0; i < (0xFC0 / 2); i += 1) {
-        set_address(CART_ADDRESS_START + 0x40 + (i * 2));
-        buffer[i] = read16();
+    // Dezaemon 3D has no header flag for its three SRAM banks, it is known by its game code.
+    if ((gSRAMPresent != 0) && (gGameCode[1] == SRAM_BANKED_GAME_CODE)) {
+        gSRAMBanked = true;
+        gSRAMSize = SRAM_BANK_SIZE * SRAM_BANKS;
     }
 
-    uint32_t crc = si_crc32((uint8_t*)buffer, sizeof(buffer));
+    uint32_t crc = si_crc32((uint8_t*)(header + (0x40 / 2)), 0xFC0);
     switch (crc) {
     case CRC_NUS_6101:
         gCICName = "6101";
@@ -356,9 +314,19 @@ void cartio_init()
         gCICName = "Unknown";
     }
 
+    timing_boot_phase(BOOT_PHASE_CART);
+}
+
+// Publish the probe results to core0, everything written before is visible once gCartReady reads true.
+void cartio_set_ready(void)
+{
+    __dmb();
+    gCartReady = true;
 }
 
 void set_address(uint32_t address) {
+    // Take the pins back from the PIO engine.
+    cartbus_release();
     if (gpio_is_output == 0) {
         set_ad_output();
     }
@@ -372,7 +340,7 @@ void set_address(uint32_t address) {
 
     gpio_put(N64_ALEL, true);
     // Leave the high 16 bits on the line for at least this long
-    busy_wait_at_least_cycles(LATCH_DELAY_NS); 
+    busy_wait_at_least_cycles(LatchDelayCycles); 
     
     // Set aleH low to send the lower 16 bits
     gpio_put(N64_ALEH, false);
@@ -382,7 +350,7 @@ void set_address(uint32_t address) {
     gpio_put_masked(address_pin_mask, low16);
 
     // Leave the low 16 bits on the line for at least this long
-    busy_wait_at_least_cycles(LATCH_DELAY_NS);
+    busy_wait_at_least_cycles(LatchDelayCycles);
 
     // set aleL low to tell the cart we are done sending the address
     gpio_put(N64_ALEL, false);
@@ -394,7 +362,7 @@ uint16_t read16() {
     }
 
     gpio_put(N64_READ, false);
-    busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
+    busy_wait_at_least_cycles(ReadLowDelayCycles);
 
     // Read the AD bus.
     gpio_put(N64_READ, true);
@@ -405,9 +373,9 @@ uint16_t read16() {
 void write32(uint32_t value)
 {
     write16((uint16_t)(value >> 16));
-    busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
+    busy_wait_at_least_cycles(ReadLowDelayCycles);
     write16((uint16_t)(value & 0xFFFF));
-    busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
+    busy_wait_at_least_cycles(ReadLowDelayCycles);
 }
 
 void write16(uint16_t value)
@@ -417,151 +385,92 @@ void write16(uint16_t value)
 
     gpio_put_masked(address_pin_mask, value);
     gpio_put(N64_WRITE, false);
-    busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
+    busy_wait_at_least_cycles(ReadLowDelayCycles);
     gpio_put(N64_WRITE, true);
 }
 
-void FlashRamEraseBlock128B(uint32_t offset)
+// The status reads back the chip id once an erase or program completed.
+bool FlashRamBusy(void)
+{
+    set_address(SRAM_ADDRESS_START + 0x10000);
+    write32(0xE1000000);
+
+    set_address(SRAM_ADDRESS_START);
+    readarr[0] = (((uint32_t)read16()) << 16) | (read16());
+    readarr[1] = (((uint32_t)read16()) << 16) | (read16());
+    return readarr[0] != 0x11118001;
+}
+
+// Start erasing the 16KB sector holding offset, the erase command takes a page number but always clears the
+// whole sector. Returns right away, poll FlashRamBusy for the end of the erase.
+void FlashRamStartEraseSector(uint32_t offset)
 {
     // Set erase address.
     set_address(0x08000000 + 0x10000);
-    write32(0x4B000000 | offset);
+    write32(0x4B000000 | ((offset & ~(FLASHRAM_SECTOR_SIZE - 1)) / FLASHRAM_PAGE_SIZE));
 
     // Execute the erase
     set_address(0x08000000 + 0x10000);
     write32(0x78000000);
 
-    // Wait for the erase to complete
     set_address(0x08000000 + 0x10000);
     write32(0xD2000000);
+}
 
-    do {
-        set_address(SRAM_ADDRESS_START + 0x10000);
-        write32(0xE1000000);
+void FlashRamStartEraseChip(void)
+{
+    set_address(0x08000000 + 0x10000);
+    write32(0x3C000000);
 
-        set_address(SRAM_ADDRESS_START);
-        readarr[0] = (((uint32_t)read16()) << 16) | (read16());
-        readarr[1] = (((uint32_t)read16()) << 16) | (read16());
-    } while (readarr[0] != 0x11118001);
+    set_address(0x08000000 + 0x10000);
+    write32(0xD2000000);
 }
 
-void FlashRamWrite512B(uint32_t address, unsigned char *buffer, bool flip)
+// Read one 128 byte page in bus order, offset is the byte offset in the save.
+void FlashRamReadPage128B(uint32_t offset, uint16_t *page)
 {
     // FLashtype 0x1E devides the set read address by 2x.
-    for (uint8_t x = 0; x < 4; x += 1) {
-        uint32_t offset = address + (x * 128);
-
-        // Check if an erase needs to happen, erase is slow so skipping it is better.
-        bool EraseNeeded = false;
-        bool WriteNeeded = false;
-        set_address(0x08000000 + 0x10000);
-        write32(0xF0000000);
-        if (gFlashType == 0x1E) {
-            set_address(0x08000000 + (offset / 2));
-        } else {
-            set_address(0x08000000 + offset);
-        }
-
-        for (uint i = 0; i < 128; i += 2) {
-            readarr[0] = ((uint32_t)read16()) & 0xFFFF;
-            uint32_t temp[3];
-            temp[0] = buffer[i + (x * 128)];
-            temp[1] = buffer[i + (x * 128) + 1];
-            temp[2] = temp[0] | temp[1] << 8;
-
-            if (flip != false) {
-                temp[2] = flip16((uint16_t)temp[2]);
-            }
-
-            temp[2] &= 0xFFFF;
-            if ((temp[2] & readarr[0]) != temp[2]) {
-                EraseNeeded = true;
-                WriteNeeded = true;
-                break;
-            }
-
-            if (temp[2] != readarr[0]) {
-                WriteNeeded = true;
-            }
-        }
-
-        if (EraseNeeded != false) {
-            FlashRamEraseBlock128B(offset / 128);
-        } else if (WriteNeeded == false) {
-            continue;
-        }
-
-        // Set write mode
-        set_address(0x08000000 + 0x10000);
-        write32(0xB4000000);
-
-        // Fill write buffer
-        set_address(0x08000000);
-        for (uint8_t i = 0; i < 128; i += 2) {
-            uint32_t temp[3];
-            temp[0] = buffer[i + (x * 128)];
-            temp[1] = buffer[i + (x * 128) + 1];
-            temp[2] = temp[0] | temp[1] << 8;
-            
-            if (flip != false) {
-                temp[2] = flip16((uint16_t)temp[2]);
-            }
-
-            write16((uint16_t)temp[2]);
-            busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
-        }
-
-        // Set write address
-        set_address(0x08000000 + 0x10000);
-        write32(0xA5000000 | (offset / 128));
-
-        // Execute write.
-        set_address(0x08000000 + 0x10000);
-        write32(0xD2000000);
-
-        do {
-            busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
-            set_address(SRAM_ADDRESS_START + 0x10000);
-            write32(0xE1000000);
-
-            set_address(SRAM_ADDRESS_START);
-            readarr[0] = (((uint32_t)read16()) << 16) | (read16());
-            readarr[1] = (((uint32_t)read16()) << 16) | (read16());
-        } while (readarr[0] != 0x11118001);
+    set_address(0x08000000 + 0x10000);
+    write32(0xF0000000);
+    if (gFlashType == 0x1E) {
+        cart_read_burst(0x08000000 + (offset / 2), page, FLASHRAM_PAGE_SIZE);
+    } else {
+        cart_read_burst(0x08000000 + offset, page, FLASHRAM_PAGE_SIZE);
     }
 }
 
-void SRAMWrite512B(uint32_t address, unsigned char *buffer, bool flip)
+// Start programming one 128 byte page from a bus order buffer, poll FlashRamBusy for the end of the program.
+// Programming only clears bits, the page has to be erased first whenever a bit goes from 0 to 1.
+void FlashRamStartProgramPage128B(uint32_t offset, const uint16_t *page)
 {
-    set_address(address);
-    busy_wait_at_least_cycles(READ_LOW_DELAY_NS * 2);
-    for (uint32_t i = 0; i < 256; i += 1) {
-        uint32_t temp[3];
-        temp[0] = buffer[i * 2];
-        temp[1] = buffer[i * 2 + 1];
-        temp[2] = temp[0] | temp[1] << 8;
-        if (flip != false) {
-            temp[2] = flip16((uint16_t)temp[2]);
-        }
+    // Set write mode
+    set_address(0x08000000 + 0x10000);
+    write32(0xB4000000);
 
-        write16((uint16_t)temp[2]);
-        busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
+    // Fill write buffer
+    set_address(0x08000000);
+    for (uint8_t i = 0; i < (FLASHRAM_PAGE_SIZE / 2); i += 1) {
+        write16(page[i]);
+        busy_wait_at_least_cycles(ReadLowDelayCycles);
     }
 
-    // No idea why this is needed but without this the first 16b does not get the correct value.
-    set_address(address);
-    busy_wait_at_least_cycles(READ_LOW_DELAY_NS * 2);
-    for (uint32_t i = 0; i < 2; i += 1) {
-        uint32_t temp[3];
-        temp[0] = buffer[i * 2];
-        temp[1] = buffer[i * 2 + 1];
-        temp[2] = temp[0] | temp[1] << 8;
-        if (flip != false) {
-            temp[2] = flip16((uint16_t)temp[2]);
-        }
+    // Set write address
+    set_address(0x08000000 + 0x10000);
+    write32(0xA5000000 | (offset / FLASHRAM_PAGE_SIZE));
+
+    // Execute write.
+    set_address(0x08000000 + 0x10000);
+    write32(0xD2000000);
+}
 
-        write16((uint16_t)temp[2]);
-        busy_wait_at_least_cycles(READ_LOW_DELAY_NS);
+// Write a run of halfwords with a single address latch, offset is the byte offset in the save.
+void SRAMWriteRun(uint32_t offset, const uint16_t *data, uint32_t count)
+{
+    set_address(sram_bus_address(offset));
+    busy_wait_at_least_cycles(ReadLowDelayCycles * 2);
+    for (uint32_t i = 0; i < count; i += 1) {
+        write16(data[i]);
+        busy_wait_at_least_cycles(ReadLowDelayCycles);
     }
 }
 
@@ -571,30 +480,28 @@ void FlashRamRead512B(uint32_t address, uint16_t *buffer, bool flip)
     write32(0xF0000000);
     for (uint32_t x = 0; x < 4; x += 1) {
         if (gFlashType == 0x1E) {
-            set_address(0x08000000 + ((address + x * 128) >> 1));
+            cart_read_burst(0x08000000 + ((address + x * 128) >> 1), buffer + (x * 64), 128);
         } else {
-            set_address(0x08000000 + (address + x * 128));
+            cart_read_burst(0x08000000 + (address + x * 128), buffer + (x * 64), 128);
         }
+    }
 
-        for (uint32_t i = 0; i < 128; i += 2) {
-            if (flip == false) {
-                buffer[(i / 2) + (x * 64)] = read16();
-            } else {
-                buffer[(i / 2) + (x * 64)] = flip16(read16());
-            }
-        }
+    if (flip != false) {
+        flip16_buffer(buffer, 512);
     }
 }
 
-void SRAMRead512B(uint32_t address, uint16_t *buffer, bool flip)
+void SRAMRead(uint32_t offset, uint16_t *buffer, uint32_t length)
 {
-    address += 0x08000000;
-    set_address(address);
-    for (uint32_t i = 0; i < 256; i += 1) {
-        if (flip != false) {
-            buffer[i] = flip16(read16());
-        } else {
-            buffer[i] = read16();
-        }
+    cart_read_burst(sram_bus_address(offset), buffer, length);
+}
+
+// Byteflip every halfword, two at a time. Length is in bytes and has to be a multiple of 4.
+void flip16_buffer(uint16_t *buffer, uint32_t length)
+{
+    uint32_t *words = (uint32_t*)buffer;
+    for (uint32_t i = 0; i < (length / 4); i += 1) {
+        uint32_t value = words[i];
+        words[i] = ((value & 0x00FF00FF) << 8) | ((value >> 8) & 0x00FF00FF);
     }
 }
\ No newline at end of file
@@ -11,6 +11,7 @@
 #pragma once
 
 #include "joybus.h"
+#include "crc32.h"
 
 #define N64_EEPROM_DAT (16)
 #define N64_EEPROM_CLK (17)
@@ -25,12 +26,28 @@
 #define N64_ALEH_PI    (27)
 
 
+#define CART_ADDRESS_START (0x10000000)
+#define SRAM_ADDRESS_START (0x08000000)
+
+// FlashRAM programs 128 byte pages, an erase always clears a 16KB sector of 128 pages.
+#define FLASHRAM_PAGE_SIZE   (128)
+#define FLASHRAM_SECTOR_SIZE (16 * 1024)
+
+// Banked SRAM (Dezaemon 3D) has three 32KB banks, selected by address bits 18 and up.
+#define SRAM_SIZE             (32 * 1024)
+#define SRAM_BANK_SIZE        (32 * 1024)
+#define SRAM_BANK_STRIDE      (0x40000)
+#define SRAM_BANKS            (3)
+#define SRAM_BANKED_GAME_CODE (0x445A) // "DZ"
+
 #define N64_ALEL       ((gGpioRemap == false) ? N64_ALEL_INIT : N64_ALEL_PI)
 #define N64_ALEH       ((gGpioRemap == false) ? N64_ALEH_INIT : N64_ALEH_PI)
 
 extern bool gGpioRemap;
+extern volatile bool gCartReady;
+extern volatile bool gCartMissing;
 
-#define READ_LOW_DELAY_NS (133 / 4) // 133 = 1us 1us / 5 = ~300ns
+#define READ_LOW_DELAY_NS (264) // Converted to system clock cycles at init, the firmware may run overclocked.
 
 enum CIC_TYPES {
     CIC_TYPE_PAL = 0,
@@ -39,19 +56,28 @@ enum CIC_TYPES {
 };
 
 void cartio_init(void);
+void cartio_set_ready(void);
 void set_address(uint32_t address);
 uint16_t read16();
 void write32(uint32_t value);
 void write16(uint16_t value);
-void FlashRamWrite512B(uint32_t address, unsigned char *buffer, bool flip);
+bool FlashRamBusy(void);
+void FlashRamStartEraseSector(uint32_t offset);
+void FlashRamStartEraseChip(void);
+void FlashRamReadPage128B(uint32_t offset, uint16_t *page);
+void FlashRamStartProgramPage128B(uint32_t offset, const uint16_t *page);
 void FlashRamRead512B(uint32_t address, uint16_t *buffer, bool flip);
-void SRAMWrite512B(uint32_t address, unsigned char *buffer, bool flip);
-void SRAMRead512B(uint32_t address, uint16_t *buffer, bool flip);
+void SRAMWriteRun(uint32_t offset, const uint16_t *data, uint32_t count);
+void SRAMRead(uint32_t offset, uint16_t *buffer, uint32_t length);
+void flip16_buffer(uint16_t *buffer, uint32_t length);
 
 extern uint32_t gRomSize;
-extern uint32_t readarr[32768];
+extern uint32_t gRomSizeProbeUs;
+extern uint32_t readarr[1024];
 extern uint32_t gFramPresent;
 extern uint32_t gSRAMPresent;
+extern uint32_t gSRAMSize;
+extern bool gSRAMBanked;
 extern uint8_t gFlashType;
 extern uint32_t gCICType;
 extern uint16_t gGameTitle[0x16];
@@ -59,6 +85,17 @@ extern uint16_t gGameCode[6];
 extern uint32_t gChecksum;
 extern const char* gCICName;
 
+// Bus address of a byte offset in the save, the banks of a banked SRAM follow each other in the save.
+// Accesses never cross a bank.
+static inline uint32_t sram_bus_address(uint32_t offset)
+{
+    if (gSRAMBanked == false) {
+        return SRAM_ADDRESS_START + offset;
+    }
+
+    return SRAM_ADDRESS_START + ((offset / SRAM_BANK_SIZE) * SRAM_BANK_STRIDE) + (offset % SRAM_BANK_SIZE);
+}
+
 inline uint16_t flip16(uint16_t value)
 {
     return (uint16_t)((uint16_t)(value) << 8) | (((uint16_t)value) >> 8);
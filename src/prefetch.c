@@ -0,0 +1,120 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Prefetch
+ * Core1 read-ahead of ROM blocks into the ROM cache for sequential host reads.
+ * Core0 reports every ROM read, once a sequential stream is seen the next blocks are queued to core1 through
+ * the inter-core FIFO. Core1 fills them into the ROM cache while core0 keeps serving USB.
+ * Blocks the USB path is waiting on go through the same FIFO, core1 does all ROM bus reads.
+ */
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "n64cartinterface.h"
+#include "romcache.h"
+#include "prefetch.h"
+#include "flashcache.h"
+#include "romhash.h"
+#include "savecache.h"
+
+// Block addresses are block aligned, bit 0 marks a block the USB path is waiting on.
+#define PREFETCH_DEMAND (1u)
+
+// A demanded range is queued once, it is only queued again when USB is still waiting on it after this long.
+// Covers a block the read-ahead evicted again before the retry got to it.
+#define PREFETCH_DEMAND_RETRY_US (20 * 1000)
+
+// Longest time core1 sleeps without a request, bounds how late an idle save write-back starts.
+#define PREFETCH_IDLE_POLL_US (10 * 1000)
+
+static_assert(PREFETCH_DEPTH < (ROMCACHE_BLOCKS / 2), "prefetch would evict the blocks it is reading ahead");
+
+static uint32_t NextAddress = 0;
+static uint32_t StreamLength = 0;
+static uint32_t RequestedUpTo = 0;
+
+// The range the USB path is waiting on, tinyusb retries the same read until it gets data.
+static uint32_t DemandAddress = 0;
+static uint32_t DemandLength = 0;
+static uint32_t DemandQueuedUpTo = 0;
+static absolute_time_t DemandRetryTime;
+uint32_t gPrefetchIssued = 0;
+
+// Core1 main loop once the cart is probed.
+void prefetch_run(void)
+{
+    while (1) {
+        // Write back the saves, mirror the ROM into the onboard flash and hash it whenever there is nothing else to do.
+        if ((multicore_fifo_rvalid() == false) &&
+            ((savecache_step() != false) || (StepEepromWriteBack() != false) || (flashcache_mirror_step() != false) ||
+             (romhash_step() != false))) {
+            continue;
+        }
+
+        // Wake up now and then even without requests, the save write-backs run on timers and poll the chip
+        // status while it erases or programs.
+        uint32_t Address;
+        uint32_t PollUs = MIN(PREFETCH_IDLE_POLL_US, MIN(savecache_poll_us(), EepromPollUs()));
+        if (multicore_fifo_pop_timeout_us(PollUs, &Address) == false) {
+            continue;
+        }
+
+        bool Demand = (Address & PREFETCH_DEMAND) != 0;
+        if ((romcache_prefetch(Address & ~PREFETCH_DEMAND, Demand) != false) && (Demand == false)) {
+            gPrefetchIssued += 1;
+        }
+    }
+}
+
+// Queue the blocks of a read the USB path is waiting on. They share the FIFO with the read-ahead and are filled in
+// order, behind any read-ahead already queued (the FIFO holds 8 entries). Retries of the same read only queue
+// what did not fit into the FIFO the last time, the FIFO is never flooded with the same block.
+void prefetch_request(uint32_t address, uint32_t length)
+{
+    if ((address != DemandAddress) || (length != DemandLength) || (time_reached(DemandRetryTime) != false)) {
+        DemandAddress = address;
+        DemandLength = length;
+        DemandQueuedUpTo = address & ~(ROMCACHE_BLOCK_SIZE - 1);
+        DemandRetryTime = make_timeout_time_us(PREFETCH_DEMAND_RETRY_US);
+    }
+
+    // Core0 is the only producer, a FIFO with room takes the push without blocking.
+    while ((DemandQueuedUpTo < (address + length)) && (multicore_fifo_wready() != false)) {
+        multicore_fifo_push_blocking(DemandQueuedUpTo | PREFETCH_DEMAND);
+        DemandQueuedUpTo += ROMCACHE_BLOCK_SIZE;
+    }
+}
+
+void prefetch_notify(uint32_t address, uint32_t length)
+{
+    if (address != NextAddress) {
+        StreamLength = 0;
+        RequestedUpTo = 0;
+    } else {
+        StreamLength += 1;
+    }
+
+    NextAddress = address + length;
+    if (StreamLength < PREFETCH_TRIGGER) {
+        return;
+    }
+
+    uint32_t Block = NextAddress & ~(ROMCACHE_BLOCK_SIZE - 1);
+    uint32_t End = Block + (PREFETCH_DEPTH * ROMCACHE_BLOCK_SIZE);
+    if (End > (CART_ADDRESS_START + gRomSize)) {
+        End = CART_ADDRESS_START + gRomSize;
+    }
+
+    if (Block < RequestedUpTo) {
+        Block = RequestedUpTo;
+    }
+
+    // Never block USB on a full FIFO, the rest gets requested on the next read.
+    while ((Block < End) && (multicore_fifo_wready() != false)) {
+        multicore_fifo_push_blocking(Block);
+        Block += ROMCACHE_BLOCK_SIZE;
+    }
+
+    RequestedUpTo = Block;
+}
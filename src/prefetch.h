@@ -0,0 +1,25 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Prefetch
+ * Core1 read-ahead of ROM blocks into the ROM cache for sequential host reads.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Number of ROM cache blocks read ahead of a sequential stream, has to stay well below ROMCACHE_BLOCKS.
+#ifndef PREFETCH_DEPTH
+#define PREFETCH_DEPTH (4)
+#endif
+
+// Number of back to back reads before a stream counts as sequential.
+#define PREFETCH_TRIGGER (2)
+
+void prefetch_run(void);
+void prefetch_request(uint32_t address, uint32_t length);
+void prefetch_notify(uint32_t address, uint32_t length);
+
+extern uint32_t gPrefetchIssued;
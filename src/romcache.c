@@ -0,0 +1,267 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * RomCache
+ * LRU block cache of native cart data, ROM.N64 and ROMF.Z64 are both served from it so a host copying
+ * both files only pays for one pass over the bus. The byteflipped view is produced from the cached data.
+ * Blocks are filled by core1, on demand for the USB path and ahead of time for sequential reads. romcache_read()
+ * still fills on the calling core for the blocking users. The entry table is guarded by a spin lock
+ * and the bus itself by the cart bus lock. Readers pin a block under the spin lock and copy its data after releasing
+ * it, pinned blocks are never evicted.
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "n64cartinterface.h"
+#include "cartbus.h"
+#include "romcache.h"
+#include "flashcache.h"
+
+enum ROMCACHE_STATE {
+    ROMCACHE_INVALID = 0,
+    ROMCACHE_FILLING = 1,
+    ROMCACHE_VALID = 2,
+};
+
+typedef struct _RomCacheEntry
+{
+    uint32_t Address;
+    uint32_t LastUse;
+    uint8_t State;
+    uint8_t Pins;
+    bool Prefetched;
+} RomCacheEntry;
+
+static uint32_t CacheData[ROMCACHE_BLOCKS][ROMCACHE_BLOCK_SIZE / 4];
+static RomCacheEntry CacheEntries[ROMCACHE_BLOCKS];
+static uint32_t CacheTick = 0;
+static spin_lock_t *CacheLock;
+uint32_t gRomCacheHits = 0;
+uint32_t gRomCacheMisses = 0;
+uint32_t gRomCachePrefetchHits = 0;
+
+void romcache_init(void)
+{
+    CacheLock = spin_lock_init((uint)spin_lock_claim_unused(true));
+    romcache_invalidate();
+}
+
+void romcache_invalidate(void)
+{
+    for (uint32_t i = 0; i < ROMCACHE_BLOCKS; i += 1) {
+        CacheEntries[i].State = ROMCACHE_INVALID;
+        CacheEntries[i].Prefetched = false;
+    }
+}
+
+// Called with the cache lock held.
+static int32_t romcache_find(uint32_t address)
+{
+    for (uint32_t i = 0; i < ROMCACHE_BLOCKS; i += 1) {
+        if ((CacheEntries[i].State != ROMCACHE_INVALID) && (CacheEntries[i].Address == address)) {
+            return (int32_t)i;
+        }
+    }
+
+    return -1;
+}
+
+// Called with the cache lock held. Prefers empty blocks, never picks one that is being filled or copied from.
+static uint32_t romcache_victim(void)
+{
+    uint32_t Victim = ROMCACHE_BLOCKS;
+    for (uint32_t i = 0; i < ROMCACHE_BLOCKS; i += 1) {
+        if (CacheEntries[i].Pins != 0) {
+            continue;
+        }
+
+        if (CacheEntries[i].State == ROMCACHE_INVALID) {
+            return i;
+        }
+
+        if (CacheEntries[i].State == ROMCACHE_FILLING) {
+            continue;
+        }
+
+        if ((Victim == ROMCACHE_BLOCKS) || (CacheEntries[i].LastUse < CacheEntries[Victim].LastUse)) {
+            Victim = i;
+        }
+    }
+
+    // At most one block per core is filling and two per core are pinned at any time.
+    assert(Victim != ROMCACHE_BLOCKS);
+    return Victim;
+}
+
+// Fill a block that was marked as filling, the caller must not hold the cache lock.
+static void romcache_fill(uint32_t index, uint32_t address)
+{
+    // Stored carts come out of the onboard flash instead of off the bus.
+    if (flashcache_read_block(address, CacheData[index]) == false) {
+        cartbus_lock();
+        cart_read_burst(address, (uint16_t*)CacheData[index], ROMCACHE_BLOCK_SIZE);
+        cartbus_unlock();
+    }
+
+    uint32_t Irq = spin_lock_blocking(CacheLock);
+    CacheEntries[index].State = ROMCACHE_VALID;
+    CacheEntries[index].LastUse = ++CacheTick;
+    spin_unlock(CacheLock, Irq);
+}
+
+static void romcache_unpin(uint32_t index)
+{
+    uint32_t Irq = spin_lock_blocking(CacheLock);
+    CacheEntries[index].Pins -= 1;
+    spin_unlock(CacheLock, Irq);
+}
+
+// Copy part of a block out of the cache, filling it first on a miss.
+static void romcache_copy(uint32_t address, uint32_t offset, uint8_t *destination, uint32_t length)
+{
+    bool Missed = false;
+    while (true) {
+        uint32_t Irq = spin_lock_blocking(CacheLock);
+        int32_t Index = romcache_find(address);
+        if ((Index >= 0) && (CacheEntries[Index].State == ROMCACHE_VALID)) {
+            CacheEntries[Index].Pins += 1;
+            CacheEntries[Index].LastUse = ++CacheTick;
+            if (Missed == false) {
+                gRomCacheHits += 1;
+                if (CacheEntries[Index].Prefetched != false) {
+                    gRomCachePrefetchHits += 1;
+                }
+            }
+
+            CacheEntries[Index].Prefetched = false;
+            spin_unlock(CacheLock, Irq);
+
+            memcpy(destination, ((const uint8_t*)CacheData[Index]) + offset, length);
+            romcache_unpin((uint32_t)Index);
+            return;
+        }
+
+        if (Index >= 0) {
+            // The prefetcher is filling this block right now, wait for it.
+            spin_unlock(CacheLock, Irq);
+            tight_loop_contents();
+            continue;
+        }
+
+        uint32_t Victim = romcache_victim();
+        CacheEntries[Victim].Address = address;
+        CacheEntries[Victim].State = ROMCACHE_FILLING;
+        CacheEntries[Victim].Prefetched = false;
+        spin_unlock(CacheLock, Irq);
+
+        gRomCacheMisses += 1;
+        Missed = true;
+        romcache_fill(Victim, address);
+    }
+}
+
+// Length is in bytes and has to be a multiple of 4, the buffer has to be word aligned.
+void romcache_read(uint32_t address, uint16_t *buffer, uint32_t length, bool flip)
+{
+    uint8_t *Destination = (uint8_t*)buffer;
+    uint32_t Remaining = length;
+    while (Remaining != 0) {
+        uint32_t BlockAddress = address & ~(ROMCACHE_BLOCK_SIZE - 1);
+        uint32_t Offset = address - BlockAddress;
+        uint32_t Chunk = ROMCACHE_BLOCK_SIZE - Offset;
+        if (Chunk > Remaining) {
+            Chunk = Remaining;
+        }
+
+        romcache_copy(BlockAddress, Offset, Destination, Chunk);
+        Destination += Chunk;
+        address += Chunk;
+        Remaining -= Chunk;
+    }
+
+    if (flip != false) {
+        flip16_buffer(buffer, length);
+    }
+}
+
+// Non-blocking read for the USB path. Copies the range and returns true only if every block it touches is cached,
+// otherwise nothing is copied and the missing blocks are left for the caller to request from core1.
+bool romcache_try_read(uint32_t address, uint16_t *buffer, uint32_t length, bool flip)
+{
+    uint32_t First = address & ~(ROMCACHE_BLOCK_SIZE - 1);
+    uint32_t Last = (address + length - 1) & ~(ROMCACHE_BLOCK_SIZE - 1);
+    int32_t Index[2];
+
+    // The USB buffer is at most one block, so a read touches two blocks at most.
+    assert(Last - First <= ROMCACHE_BLOCK_SIZE);
+    uint32_t Irq = spin_lock_blocking(CacheLock);
+    Index[0] = romcache_find(First);
+    Index[1] = romcache_find(Last);
+    for (uint32_t i = 0; i < 2; i += 1) {
+        if ((Index[i] < 0) || (CacheEntries[Index[i]].State != ROMCACHE_VALID)) {
+            if (Index[i] < 0) {
+                gRomCacheMisses += 1;
+            }
+
+            spin_unlock(CacheLock, Irq);
+            return false;
+        }
+    }
+
+    // Pin the blocks and copy with the lock released, core1 needs the lock for every fill and the copy is up to 4KB.
+    uint32_t Blocks = (Last != First) ? 2 : 1;
+    for (uint32_t i = 0; i < Blocks; i += 1) {
+        CacheEntries[Index[i]].Pins += 1;
+        CacheEntries[Index[i]].LastUse = ++CacheTick;
+        gRomCacheHits += 1;
+        if (CacheEntries[Index[i]].Prefetched != false) {
+            gRomCachePrefetchHits += 1;
+            CacheEntries[Index[i]].Prefetched = false;
+        }
+    }
+
+    spin_unlock(CacheLock, Irq);
+
+    uint8_t *Destination = (uint8_t*)buffer;
+    uint32_t Remaining = length;
+    for (uint32_t i = 0; i < Blocks; i += 1) {
+        uint32_t Offset = (i == 0) ? (address - First) : 0;
+        uint32_t Chunk = ROMCACHE_BLOCK_SIZE - Offset;
+        if (Chunk > Remaining) {
+            Chunk = Remaining;
+        }
+
+        memcpy(Destination, ((const uint8_t*)CacheData[Index[i]]) + Offset, Chunk);
+        romcache_unpin((uint32_t)Index[i]);
+        Destination += Chunk;
+        Remaining -= Chunk;
+    }
+
+    if (flip != false) {
+        flip16_buffer(buffer, length);
+    }
+
+    return true;
+}
+
+// Bring a block into the cache, returns false if it was already there.
+// Demand fills are blocks a reader is waiting on and do not count as prefetch hits.
+bool romcache_prefetch(uint32_t address, bool demand)
+{
+    uint32_t Irq = spin_lock_blocking(CacheLock);
+    if (romcache_find(address) >= 0) {
+        spin_unlock(CacheLock, Irq);
+        return false;
+    }
+
+    uint32_t Victim = romcache_victim();
+    CacheEntries[Victim].Address = address;
+    CacheEntries[Victim].State = ROMCACHE_FILLING;
+    CacheEntries[Victim].Prefetched = (demand == false);
+    spin_unlock(CacheLock, Irq);
+
+    romcache_fill(Victim, address);
+    return true;
+}
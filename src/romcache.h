@@ -0,0 +1,26 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * RomCache
+ * LRU block cache of native cart data, ROM.N64 and ROMF.Z64 are both served from it so a host copying
+ * both files only pays for one pass over the bus.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ROMCACHE_BLOCK_SIZE (4096)
+#define ROMCACHE_BLOCKS     (16)
+
+void romcache_init(void);
+void romcache_read(uint32_t address, uint16_t *buffer, uint32_t length, bool flip);
+bool romcache_try_read(uint32_t address, uint16_t *buffer, uint32_t length, bool flip);
+bool romcache_prefetch(uint32_t address, bool demand);
+void romcache_invalidate(void);
+
+extern uint32_t gRomCacheHits;
+extern uint32_t gRomCacheMisses;
+extern uint32_t gRomCachePrefetchHits;
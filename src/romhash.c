@@ -0,0 +1,266 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * RomHash
+ * CRC32, MD5 and SHA-1 of the ROM in z64 (big endian) byte order, the order ROM databases list them in.
+ * Core1 walks the ROM one cache block at a time whenever the host leaves it idle. The CRC32 comes for free from
+ * the DMA sniffer: each block is pushed through a DMA channel with sniffing enabled while the CPU runs MD5 and
+ * SHA-1 over the same buffer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
+#include "n64cartinterface.h"
+#include "cartbus.h"
+#include "romcache.h"
+#include "flashcache.h"
+#include "romhash.h"
+
+// Sniffer calculation mode for CRC-32 with bit reversed data, reversing and inverting the result gives the zip CRC32.
+#define SNIFF_CRC32_REVERSED (0x1)
+
+volatile bool gRomHashDone = false;
+uint32_t gRomHashBytes = 0;
+uint32_t gRomHashTimeMs = 0;
+
+static uint HashDma;
+static dma_channel_config HashDmaConfig;
+static uint8_t SniffSink;
+static uint32_t HashBuffer[ROMCACHE_BLOCK_SIZE / 4];
+static uint32_t HashSize;
+static uint32_t StartTimeMs;
+
+static uint32_t Crc;
+static uint32_t Md5State[4];
+static uint32_t Sha1State[5];
+
+static const uint32_t Md5K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t Md5Shift[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+static inline uint32_t rotl32(uint32_t value, uint32_t shift)
+{
+    return (value << shift) | (value >> (32 - shift));
+}
+
+// One 64 byte block, the message words are little endian and so is the RP2040.
+static void md5_block(const uint32_t *m)
+{
+    uint32_t a = Md5State[0];
+    uint32_t b = Md5State[1];
+    uint32_t c = Md5State[2];
+    uint32_t d = Md5State[3];
+
+    for (uint32_t i = 0; i < 64; i += 1) {
+        uint32_t f;
+        uint32_t g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = ((5 * i) + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = ((3 * i) + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+
+        f += a + Md5K[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += rotl32(f, Md5Shift[((i >> 4) << 2) | (i & 3)]);
+    }
+
+    Md5State[0] += a;
+    Md5State[1] += b;
+    Md5State[2] += c;
+    Md5State[3] += d;
+}
+
+// One 64 byte block, the message words are big endian. The schedule is kept as a 16 word ring.
+static void sha1_block(const uint8_t *data)
+{
+    uint32_t W[16];
+    for (uint32_t i = 0; i < 16; i += 1) {
+        W[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[(i * 4) + 1] << 16) |
+               ((uint32_t)data[(i * 4) + 2] << 8) | data[(i * 4) + 3];
+    }
+
+    uint32_t a = Sha1State[0];
+    uint32_t b = Sha1State[1];
+    uint32_t c = Sha1State[2];
+    uint32_t d = Sha1State[3];
+    uint32_t e = Sha1State[4];
+
+    for (uint32_t i = 0; i < 80; i += 1) {
+        if (i >= 16) {
+            W[i & 15] = rotl32(W[(i + 13) & 15] ^ W[(i + 8) & 15] ^ W[(i + 2) & 15] ^ W[i & 15], 1);
+        }
+
+        uint32_t f;
+        uint32_t k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        uint32_t t = rotl32(a, 5) + f + e + k + W[i & 15];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = t;
+    }
+
+    Sha1State[0] += a;
+    Sha1State[1] += b;
+    Sha1State[2] += c;
+    Sha1State[3] += d;
+    Sha1State[4] += e;
+}
+
+void romhash_init(void)
+{
+    HashDma = (uint)dma_claim_unused_channel(true);
+    HashDmaConfig = dma_channel_get_default_config(HashDma);
+    channel_config_set_transfer_data_size(&HashDmaConfig, DMA_SIZE_8);
+    channel_config_set_read_increment(&HashDmaConfig, true);
+    channel_config_set_write_increment(&HashDmaConfig, false);
+    channel_config_set_sniff_enable(&HashDmaConfig, true);
+}
+
+static void romhash_start(void)
+{
+    // The ROM size is taken once, a pass always covers whole cache blocks.
+    HashSize = gRomSize & ~(ROMCACHE_BLOCK_SIZE - 1);
+    StartTimeMs = to_ms_since_boot(get_absolute_time());
+
+    dma_sniffer_enable(HashDma, SNIFF_CRC32_REVERSED, true);
+    dma_sniffer_set_output_reverse_enabled(true);
+    dma_sniffer_set_output_invert_enabled(true);
+    dma_sniffer_set_data_accumulator(0xFFFFFFFF);
+
+    Md5State[0] = 0x67452301;
+    Md5State[1] = 0xefcdab89;
+    Md5State[2] = 0x98badcfe;
+    Md5State[3] = 0x10325476;
+    Sha1State[0] = 0x67452301;
+    Sha1State[1] = 0xEFCDAB89;
+    Sha1State[2] = 0x98BADCFE;
+    Sha1State[3] = 0x10325476;
+    Sha1State[4] = 0xC3D2E1F0;
+}
+
+// The ROM is a whole number of blocks, so the padding always takes a block of its own.
+static void romhash_finish(void)
+{
+    uint64_t Bits = (uint64_t)HashSize * 8;
+    uint32_t Pad[16];
+
+    memset(Pad, 0, sizeof(Pad));
+    ((uint8_t*)Pad)[0] = 0x80;
+    Pad[14] = (uint32_t)Bits;
+    Pad[15] = (uint32_t)(Bits >> 32);
+    md5_block(Pad);
+
+    for (uint32_t i = 0; i < 8; i += 1) {
+        ((uint8_t*)Pad)[56 + i] = (uint8_t)(Bits >> (56 - (i * 8)));
+    }
+
+    sha1_block((const uint8_t*)Pad);
+    Crc = dma_sniffer_get_data_accumulator();
+    dma_sniffer_disable();
+}
+
+// Hash the next block, called by core1 whenever it has nothing else to do. Returns false once the hashes are done.
+bool romhash_step(void)
+{
+    if (gRomHashDone != false) {
+        return false;
+    }
+
+    if (gRomHashBytes == 0) {
+        romhash_start();
+    }
+
+    uint32_t Address = CART_ADDRESS_START + gRomHashBytes;
+    if (flashcache_read_block(Address, HashBuffer) == false) {
+        cartbus_lock();
+        cart_read_burst(Address, (uint16_t*)HashBuffer, sizeof(HashBuffer));
+        cartbus_unlock();
+    }
+
+    flip16_buffer((uint16_t*)HashBuffer, sizeof(HashBuffer));
+    dma_channel_configure(HashDma, &HashDmaConfig, &SniffSink, HashBuffer, sizeof(HashBuffer), true);
+    for (uint32_t i = 0; i < (sizeof(HashBuffer) / 4); i += 16) {
+        md5_block(&HashBuffer[i]);
+        sha1_block((const uint8_t*)&HashBuffer[i]);
+    }
+
+    dma_channel_wait_for_finish_blocking(HashDma);
+    gRomHashBytes += sizeof(HashBuffer);
+    if (gRomHashBytes >= HashSize) {
+        romhash_finish();
+        gRomHashTimeMs = to_ms_since_boot(get_absolute_time()) - StartTimeMs;
+        __dmb();
+        gRomHashDone = true;
+    }
+
+    return true;
+}
+
+// Text of HASHES.TXT, returns the number of characters written.
+uint32_t romhash_report(char *buffer, uint32_t size)
+{
+    if (gRomHashDone == false) {
+        uint32_t Percent = (HashSize != 0) ? (uint32_t)(((uint64_t)gRomHashBytes * 100) / HashSize) : 0;
+        return (uint32_t)snprintf(buffer, size,
+                                  "\nROMF.Z64 hashes:\n\n"
+                                  "    Hashing - %lu%% done, reopen this file once the hashes are complete.\n",
+                                  Percent);
+    }
+
+    char Md5String[33];
+    for (uint32_t i = 0; i < 16; i += 1) {
+        sprintf(&Md5String[i * 2], "%02x", ((const uint8_t*)Md5State)[i]);
+    }
+
+    return (uint32_t)snprintf(buffer, size,
+                              "\nROMF.Z64 hashes:\n\n"
+                              "    Size    - %luMB\n"
+                              "    CRC32   - %08lx\n"
+                              "    MD5     - %s\n"
+                              "    SHA-1   - %08lx%08lx%08lx%08lx%08lx\n"
+                              "    Time    - %lums\n",
+                              (HashSize / (1024 * 1024)),
+                              Crc,
+                              Md5String,
+                              Sha1State[0], Sha1State[1], Sha1State[2], Sha1State[3], Sha1State[4],
+                              gRomHashTimeMs);
+}
@@ -0,0 +1,20 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * RomHash
+ * CRC32, MD5 and SHA-1 of the ROM, computed by core1 in the background and served as HASHES.TXT.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void romhash_init(void);
+bool romhash_step(void);
+uint32_t romhash_report(char *buffer, uint32_t size);
+
+extern volatile bool gRomHashDone;
+extern uint32_t gRomHashBytes;
+extern uint32_t gRomHashTimeMs;
@@ -0,0 +1,68 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * RomSize
+ * ROM size detection. Carts decode fewer address lines than the 64MB window, past its end a ROM either mirrors
+ * from the start or nothing drives the bus. The probe checks the known ROM sizes for either from small to large.
+ * The bus access comes in through a reader, so the host tests can feed it simulated carts.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "n64cartinterface.h"
+#include "romsize.h"
+
+// ROM size boundaries in MB, the power of two sizes and the sizes of the odd carts in between.
+static const uint8_t RomSizeCandidates[] = { 4, 8, 12, 16, 20, 24, 32, 40, 48 };
+
+// Each halfword of an open bus reads back the low halfword of the latched address, bursts included.
+bool romsize_is_open_bus(const uint32_t *block, uint32_t address)
+{
+    uint32_t Pattern = (address & 0xFFFF) | (address << 16);
+    for (uint32_t i = 0; i < (ROMSIZE_PROBE_SIZE / 4); i += 1) {
+        if (block[i] != Pattern) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The ROM ends at a boundary if the block there mirrors the first block of the ROM or nothing answers.
+static bool romsize_ends_at(RomSizeReader reader, uint32_t offset, uint32_t HeaderCrc)
+{
+    uint32_t Block[ROMSIZE_PROBE_SIZE / 4];
+    reader(CART_ADDRESS_START + offset, (uint16_t*)Block, sizeof(Block));
+    if (si_crc32((const uint8_t*)Block, sizeof(Block)) == HeaderCrc) {
+        return true;
+    }
+
+    if (romsize_is_open_bus(Block, CART_ADDRESS_START + offset) == false) {
+        return false;
+    }
+
+    // A boundary latches a low halfword of 0, which a zero filled ROM block reads back just the same.
+    // Confirm at an address with a distinctive low halfword.
+    reader(CART_ADDRESS_START + offset + ROMSIZE_OPENBUS_OFFSET, (uint16_t*)Block, sizeof(Block));
+    return romsize_is_open_bus(Block, CART_ADDRESS_START + offset + ROMSIZE_OPENBUS_OFFSET);
+}
+
+// Walk the size candidates from small to large, small carts are done after a few bursts and a 64MB cart takes
+// ten. Every probe is a 512 byte burst compared by CRC, so a single matching word is no longer enough.
+uint32_t romsize_probe(RomSizeReader reader)
+{
+    uint32_t Block[ROMSIZE_PROBE_SIZE / 4];
+    reader(CART_ADDRESS_START, (uint16_t*)Block, sizeof(Block));
+    uint32_t HeaderCrc = si_crc32((const uint8_t*)Block, sizeof(Block));
+
+    for (uint32_t i = 0; i < (sizeof(RomSizeCandidates) / sizeof(RomSizeCandidates[0])); i += 1) {
+        uint32_t Offset = (uint32_t)RomSizeCandidates[i] * 1024 * 1024;
+        if (romsize_ends_at(reader, Offset, HeaderCrc) != false) {
+            return Offset;
+        }
+    }
+
+    return ROMSIZE_MAX;
+}
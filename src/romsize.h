@@ -0,0 +1,22 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * RomSize
+ * ROM size detection by mirroring and open bus at the size boundaries.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ROMSIZE_PROBE_SIZE     (0x200)
+#define ROMSIZE_OPENBUS_OFFSET (0x5A00)
+#define ROMSIZE_MAX            (64 * 1024 * 1024)
+
+// Burst read of the cart, cart_read_burst on the device and a simulated cart in the host tests.
+typedef void (*RomSizeReader)(uint32_t address, uint16_t *buffer, uint32_t length);
+
+bool romsize_is_open_bus(const uint32_t *block, uint32_t address);
+uint32_t romsize_probe(RomSizeReader reader);
@@ -0,0 +1,517 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * SaveCache
+ * RAM shadow of the FlashRAM or SRAM save. The whole image is read once after the cart probe, host reads are
+ * served from RAM and host writes only update the image and mark the changed 128 byte pages dirty. Core1 writes
+ * the dirty pages back when the host goes idle, when the flush timeout runs out or when the disk is ejected, so a
+ * save copied to ROM.FLA no longer stalls the USB stack.
+ * A banked SRAM shows up as its banks one after the other.
+ * SRAM pages are read back first and only the changed halfword runs are written, each with a single address
+ * latch. Reading the page back again verifies the runs and rewrites the ones that did not stick.
+ * The FlashRAM write-back works one 16KB erase sector at a time: the sector is erased at most once, and not at all when
+ * the dirty pages only clear bits. A rewrite of the whole file uses a single chip erase.
+ * Erases and programs are only started by a step, later steps poll the chip status. Meanwhile core1 keeps serving
+ * ROM reads, the first poll waits for most of the last measured duration of the same operation and polls after
+ * that back off exponentially.
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "n64cartinterface.h"
+#include "cartbus.h"
+#include "savecache.h"
+
+#define SAVECACHE_PAGES        (SAVECACHE_SIZE / SAVECACHE_PAGE_SIZE)
+#define SAVECACHE_SECTOR_PAGES (FLASHRAM_SECTOR_SIZE / SAVECACHE_PAGE_SIZE)
+#define SAVECACHE_SECTOR_WORDS (SAVECACHE_SECTOR_PAGES / 32)
+
+// Write passes per SRAM page, every pass after the first one rewrites the runs the read back shows as wrong.
+#define SAVECACHE_SRAM_PASSES  (4)
+
+// Status poll back-off while the chip is still busy past its measured duration.
+#define SAVECACHE_POLL_MIN_US  (20)
+#define SAVECACHE_POLL_MAX_US  (2000)
+
+static_assert(SAVECACHE_PAGE_SIZE == FLASHRAM_PAGE_SIZE, "dirty pages have to match the FlashRAM program unit");
+
+enum SAVECACHE_OP {
+    SAVECACHE_OP_NONE = 0,
+    SAVECACHE_OP_ERASE_CHIP,
+    SAVECACHE_OP_ERASE_SECTOR,
+    SAVECACHE_OP_PROGRAM,
+    SAVECACHE_OP_COUNT,
+};
+
+static uint32_t SaveImage[SAVECACHE_SIZE / 4];
+static uint32_t DirtyPages[SAVECACHE_PAGES / 32];
+static uint32_t WrittenPages[SAVECACHE_PAGES / 32];
+static volatile uint32_t DirtyCount = 0;
+static uint32_t FirstDirtyMs;
+static uint32_t LastWriteMs;
+static volatile bool FlushRequested = false;
+static spin_lock_t *SaveLock;
+
+// Write-back in progress, Sector is the erase unit being programmed and SectorPages the pages of it still to do.
+static bool WriteBack = false;
+static uint32_t WriteBackStartMs;
+static uint32_t Sector;
+static uint32_t SectorPages[SAVECACHE_SECTOR_WORDS];
+
+// Erase or program the chip is busy with.
+static enum SAVECACHE_OP PendingOp = SAVECACHE_OP_NONE;
+static uint32_t OpStartUs;
+static uint32_t NextPollUs;
+static uint32_t PollIntervalUs;
+static uint32_t OpMeasuredUs[SAVECACHE_OP_COUNT];
+
+enum SAVE_TYPE gSaveType = SAVE_TYPE_NONE;
+uint32_t gSaveSize = 0;
+uint32_t gSaveWriteBacks = 0;
+uint32_t gSaveErases = 0;
+uint32_t gSavePrograms = 0;
+uint32_t gSaveRewrites = 0;
+bool gSaveChipErased = false;
+uint32_t gSaveWriteBackMs = 0;
+
+static inline uint32_t savecache_now_ms(void)
+{
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static inline bool savecache_bit(const uint32_t *bitmap, uint32_t index)
+{
+    return (bitmap[index / 32] & (1u << (index % 32))) != 0;
+}
+
+static uint32_t savecache_popcount(uint32_t value)
+{
+    uint32_t Count = 0;
+    while (value != 0) {
+        value &= value - 1;
+        Count += 1;
+    }
+
+    return Count;
+}
+
+static void savecache_copy_page(uint32_t page, uint32_t *data)
+{
+    uint32_t Irq = spin_lock_blocking(SaveLock);
+    memcpy(data, ((const uint8_t*)SaveImage) + (page * SAVECACHE_PAGE_SIZE), SAVECACHE_PAGE_SIZE);
+    spin_unlock(SaveLock, Irq);
+}
+
+// An erased page reads back as all ones, it needs no program after an erase.
+static bool savecache_page_blank(const uint32_t *data)
+{
+    for (uint32_t i = 0; i < (SAVECACHE_PAGE_SIZE / 4); i += 1) {
+        if (data[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Called by core1 after the cart probe, before the disk reports ready.
+void savecache_init(void)
+{
+    SaveLock = spin_lock_init((uint)spin_lock_claim_unused(true));
+    if (gFramPresent != 0) {
+        gSaveSize = SAVECACHE_SIZE;
+        cartbus_lock();
+        for (uint32_t Offset = 0; Offset < gSaveSize; Offset += SAVECACHE_SECTOR_SIZE) {
+            FlashRamRead512B(Offset, ((uint16_t*)SaveImage) + (Offset / 2), false);
+        }
+
+        cartbus_unlock();
+        gSaveType = SAVE_TYPE_FLASHRAM;
+    } else if (gSRAMPresent != 0) {
+        gSaveSize = gSRAMSize;
+        cartbus_lock();
+        for (uint32_t Offset = 0; Offset < gSaveSize; Offset += SAVECACHE_SECTOR_SIZE) {
+            SRAMRead(Offset, ((uint16_t*)SaveImage) + (Offset / 2), SAVECACHE_SECTOR_SIZE);
+        }
+
+        cartbus_unlock();
+        gSaveType = SAVE_TYPE_SRAM;
+    }
+}
+
+// SRAM is byte flipped in ROM.FLA as well as in ROMF.RAM, the byte order existing SRAM dumps have.
+static inline bool savecache_flipped(bool flip)
+{
+    return (flip != false) || (gSaveType == SAVE_TYPE_SRAM);
+}
+
+// The file is always 128KB, the part past the end of a smaller save reads as zeros and ignores writes.
+void savecache_read(uint32_t offset, uint8_t *buffer, bool flip)
+{
+    if (offset >= gSaveSize) {
+        memset(buffer, 0, SAVECACHE_SECTOR_SIZE);
+        return;
+    }
+
+    uint32_t Irq = spin_lock_blocking(SaveLock);
+    memcpy(buffer, ((const uint8_t*)SaveImage) + offset, SAVECACHE_SECTOR_SIZE);
+    spin_unlock(SaveLock, Irq);
+    if (savecache_flipped(flip) != false) {
+        flip16_buffer((uint16_t*)buffer, SAVECACHE_SECTOR_SIZE);
+    }
+}
+
+void savecache_write(uint32_t offset, const uint8_t *buffer, bool flip)
+{
+    if (offset >= gSaveSize) {
+        return;
+    }
+
+    uint32_t Sector[SAVECACHE_SECTOR_SIZE / 4];
+    memcpy(Sector, buffer, sizeof(Sector));
+    if (savecache_flipped(flip) != false) {
+        flip16_buffer((uint16_t*)Sector, sizeof(Sector));
+    }
+
+    uint32_t Now = savecache_now_ms();
+    uint32_t Irq = spin_lock_blocking(SaveLock);
+    for (uint32_t i = 0; i < (SAVECACHE_SECTOR_SIZE / SAVECACHE_PAGE_SIZE); i += 1) {
+        uint32_t Page = (offset / SAVECACHE_PAGE_SIZE) + i;
+        uint8_t *Image = ((uint8_t*)SaveImage) + (Page * SAVECACHE_PAGE_SIZE);
+        const uint8_t *Data = ((const uint8_t*)Sector) + (i * SAVECACHE_PAGE_SIZE);
+        WrittenPages[Page / 32] |= (1u << (Page % 32));
+        if (memcmp(Image, Data, SAVECACHE_PAGE_SIZE) == 0) {
+            continue;
+        }
+
+        memcpy(Image, Data, SAVECACHE_PAGE_SIZE);
+        if (savecache_bit(DirtyPages, Page) == false) {
+            if (DirtyCount == 0) {
+                FirstDirtyMs = Now;
+            }
+
+            DirtyPages[Page / 32] |= (1u << (Page % 32));
+            DirtyCount += 1;
+        }
+    }
+
+    LastWriteMs = Now;
+    spin_unlock(SaveLock, Irq);
+}
+
+// Write everything back as soon as possible, the host is about to go away.
+void savecache_flush(void)
+{
+    FlushRequested = true;
+}
+
+static void savecache_start_op(enum SAVECACHE_OP op)
+{
+    OpStartUs = time_us_32();
+    NextPollUs = OpStartUs + ((OpMeasuredUs[op] * 3) / 4);
+    PollIntervalUs = SAVECACHE_POLL_MIN_US;
+    PendingOp = op;
+}
+
+// After a chip erase every page holding data has to be programmed again.
+static void savecache_chip_erased(void)
+{
+    uint32_t Data[SAVECACHE_PAGE_SIZE / 4];
+    for (uint32_t Page = 0; Page < SAVECACHE_PAGES; Page += 1) {
+        savecache_copy_page(Page, Data);
+        uint32_t Irq = spin_lock_blocking(SaveLock);
+        if ((savecache_bit(DirtyPages, Page) == false) && (savecache_page_blank(Data) == false)) {
+            DirtyPages[Page / 32] |= (1u << (Page % 32));
+            DirtyCount += 1;
+        }
+
+        spin_unlock(SaveLock, Irq);
+    }
+}
+
+// The sector erase cleared the clean pages of the sector too, every page holding data is programmed again.
+static void savecache_sector_erased(void)
+{
+    uint32_t Data[SAVECACHE_PAGE_SIZE / 4];
+    for (uint32_t i = 0; i < SAVECACHE_SECTOR_PAGES; i += 1) {
+        savecache_copy_page((Sector * SAVECACHE_SECTOR_PAGES) + i, Data);
+        if (savecache_page_blank(Data) == false) {
+            SectorPages[i / 32] |= (1u << (i % 32));
+        } else {
+            SectorPages[i / 32] &= ~(1u << (i % 32));
+        }
+    }
+}
+
+// Check whether the pending operation completed, returns false while the chip is still busy.
+static bool savecache_poll(void)
+{
+    uint32_t Now = time_us_32();
+    if ((int32_t)(Now - NextPollUs) < 0) {
+        return false;
+    }
+
+    cartbus_lock();
+    bool Busy = FlashRamBusy();
+    cartbus_unlock();
+    if (Busy != false) {
+        NextPollUs = Now + PollIntervalUs;
+        PollIntervalUs = MIN(PollIntervalUs * 2, SAVECACHE_POLL_MAX_US);
+        return false;
+    }
+
+    // The next operation of the same kind is expected to take about as long.
+    OpMeasuredUs[PendingOp] = Now - OpStartUs;
+    enum SAVECACHE_OP Done = PendingOp;
+    PendingOp = SAVECACHE_OP_NONE;
+    if (Done == SAVECACHE_OP_ERASE_CHIP) {
+        savecache_chip_erased();
+    } else if (Done == SAVECACHE_OP_ERASE_SECTOR) {
+        savecache_sector_erased();
+    } else {
+        gSavePrograms += 1;
+    }
+
+    return true;
+}
+
+// Start a write-back. When the host rewrote the whole file and every sector changed, one chip erase replaces
+// the sector erases and every page holding data is programmed again.
+static void savecache_begin(void)
+{
+    WriteBack = true;
+    WriteBackStartMs = savecache_now_ms();
+    gSaveErases = 0;
+    gSavePrograms = 0;
+    gSaveRewrites = 0;
+    gSaveChipErased = false;
+
+    bool ChipErase = (gSaveType == SAVE_TYPE_FLASHRAM);
+    uint32_t Irq = spin_lock_blocking(SaveLock);
+    for (uint32_t i = 0; i < (SAVECACHE_PAGES / 32); i += 1) {
+        if (WrittenPages[i] != 0xFFFFFFFF) {
+            ChipErase = false;
+        }
+
+        WrittenPages[i] = 0;
+    }
+
+    for (uint32_t i = 0; i < (SAVECACHE_PAGES / 32); i += SAVECACHE_SECTOR_WORDS) {
+        uint32_t Dirty = 0;
+        for (uint32_t j = 0; j < SAVECACHE_SECTOR_WORDS; j += 1) {
+            Dirty |= DirtyPages[i + j];
+        }
+
+        if (Dirty == 0) {
+            ChipErase = false;
+        }
+    }
+
+    spin_unlock(SaveLock, Irq);
+    if (ChipErase == false) {
+        return;
+    }
+
+    cartbus_lock();
+    FlashRamStartEraseChip();
+    cartbus_unlock();
+    savecache_start_op(SAVECACHE_OP_ERASE_CHIP);
+    gSaveErases += 1;
+    gSaveChipErased = true;
+}
+
+// Take the dirty pages of the next sector and read them back. Pages the chip already holds are dropped, one page
+// needing a bit set takes the whole sector through a single erase.
+static void savecache_plan_sector(void)
+{
+    uint32_t Irq = spin_lock_blocking(SaveLock);
+    uint32_t Word = 0;
+    while (DirtyPages[Word] == 0) {
+        Word += 1;
+    }
+
+    Sector = Word / SAVECACHE_SECTOR_WORDS;
+    for (uint32_t i = 0; i < SAVECACHE_SECTOR_WORDS; i += 1) {
+        SectorPages[i] = DirtyPages[(Sector * SAVECACHE_SECTOR_WORDS) + i];
+        DirtyPages[(Sector * SAVECACHE_SECTOR_WORDS) + i] = 0;
+        DirtyCount -= savecache_popcount(SectorPages[i]);
+    }
+
+    spin_unlock(SaveLock, Irq);
+
+    uint32_t Data[SAVECACHE_PAGE_SIZE / 4];
+    uint32_t Current[SAVECACHE_PAGE_SIZE / 4];
+    bool EraseNeeded = false;
+    cartbus_lock();
+    for (uint32_t i = 0; (i < SAVECACHE_SECTOR_PAGES) && (EraseNeeded == false); i += 1) {
+        if (savecache_bit(SectorPages, i) == false) {
+            continue;
+        }
+
+        uint32_t Page = (Sector * SAVECACHE_SECTOR_PAGES) + i;
+        savecache_copy_page(Page, Data);
+        FlashRamReadPage128B(Page * SAVECACHE_PAGE_SIZE, (uint16_t*)Current);
+        for (uint32_t j = 0; j < (SAVECACHE_PAGE_SIZE / 4); j += 1) {
+            if ((Data[j] & Current[j]) != Data[j]) {
+                EraseNeeded = true;
+                break;
+            }
+        }
+
+        if (memcmp(Data, Current, sizeof(Data)) == 0) {
+            SectorPages[i / 32] &= ~(1u << (i % 32));
+        }
+    }
+
+    if (EraseNeeded != false) {
+        FlashRamStartEraseSector(Sector * FLASHRAM_SECTOR_SIZE);
+        savecache_start_op(SAVECACHE_OP_ERASE_SECTOR);
+        gSaveErases += 1;
+    }
+
+    cartbus_unlock();
+}
+
+// Start programming the next page of the current sector, returns false once the sector is done.
+static bool savecache_program_page(void)
+{
+    uint32_t i = 0;
+    while ((i < SAVECACHE_SECTOR_PAGES) && (savecache_bit(SectorPages, i) == false)) {
+        i += 1;
+    }
+
+    if (i == SAVECACHE_SECTOR_PAGES) {
+        return false;
+    }
+
+    SectorPages[i / 32] &= ~(1u << (i % 32));
+
+    // The image is copied right before programming, a host write racing the program marks the page dirty again.
+    uint32_t Page = (Sector * SAVECACHE_SECTOR_PAGES) + i;
+    uint32_t Data[SAVECACHE_PAGE_SIZE / 4];
+    savecache_copy_page(Page, Data);
+    cartbus_lock();
+    FlashRamStartProgramPage128B(Page * SAVECACHE_PAGE_SIZE, (const uint16_t*)Data);
+    cartbus_unlock();
+    savecache_start_op(SAVECACHE_OP_PROGRAM);
+    return true;
+}
+
+// Write back the next dirty SRAM page, SRAM takes writes right away so there is no operation to wait for.
+static void savecache_sram_page(void)
+{
+    uint32_t Irq = spin_lock_blocking(SaveLock);
+    uint32_t Page = 0;
+    while (savecache_bit(DirtyPages, Page) == false) {
+        Page += 1;
+    }
+
+    DirtyPages[Page / 32] &= ~(1u << (Page % 32));
+    DirtyCount -= 1;
+    spin_unlock(SaveLock, Irq);
+
+    uint16_t Data[SAVECACHE_PAGE_SIZE / 2];
+    uint16_t Current[SAVECACHE_PAGE_SIZE / 2];
+    uint32_t Offset = Page * SAVECACHE_PAGE_SIZE;
+    savecache_copy_page(Page, (uint32_t*)Data);
+    cartbus_lock();
+    for (uint32_t Pass = 0; Pass < SAVECACHE_SRAM_PASSES; Pass += 1) {
+        SRAMRead(Offset, Current, SAVECACHE_PAGE_SIZE);
+        bool Clean = true;
+        uint32_t i = 0;
+        while (i < (SAVECACHE_PAGE_SIZE / 2)) {
+            if (Data[i] == Current[i]) {
+                i += 1;
+                continue;
+            }
+
+            uint32_t End = i + 1;
+            while ((End < (SAVECACHE_PAGE_SIZE / 2)) && (Data[End] != Current[End])) {
+                End += 1;
+            }
+
+            SRAMWriteRun(Offset + (i * 2), &Data[i], End - i);
+            if (Pass == 0) {
+                gSavePrograms += 1;
+            } else {
+                gSaveRewrites += 1;
+            }
+
+            Clean = false;
+            i = End;
+        }
+
+        if (Clean != false) {
+            break;
+        }
+    }
+
+    cartbus_unlock();
+}
+
+// Advance the write-back by one step, called by core1 whenever it has nothing else to do. Returns false while
+// there is nothing to do, including while the chip is busy with an erase or program.
+bool savecache_step(void)
+{
+    if (PendingOp != SAVECACHE_OP_NONE) {
+        return savecache_poll();
+    }
+
+    if ((WriteBack != false) && (savecache_program_page() != false)) {
+        return true;
+    }
+
+    if (DirtyCount == 0) {
+        if (WriteBack != false) {
+            WriteBack = false;
+            gSaveWriteBacks += 1;
+            gSaveWriteBackMs = savecache_now_ms() - WriteBackStartMs;
+        }
+
+        FlushRequested = false;
+        return false;
+    }
+
+    if (WriteBack == false) {
+        uint32_t Now = savecache_now_ms();
+        if ((FlushRequested == false) && ((Now - LastWriteMs) < SAVECACHE_IDLE_MS) &&
+            ((Now - FirstDirtyMs) < SAVECACHE_TIMEOUT_MS)) {
+            return false;
+        }
+
+        savecache_begin();
+        return true;
+    }
+
+    if (gSaveType == SAVE_TYPE_SRAM) {
+        savecache_sram_page();
+    } else {
+        savecache_plan_sector();
+    }
+
+    return true;
+}
+
+// How long core1 may sleep before the next status poll is due, SAVECACHE_NO_POLL without a pending operation.
+uint32_t savecache_poll_us(void)
+{
+    if (PendingOp == SAVECACHE_OP_NONE) {
+        return SAVECACHE_NO_POLL;
+    }
+
+    int32_t Remaining = (int32_t)(NextPollUs - time_us_32());
+    return (Remaining > 0) ? (uint32_t)Remaining : 0;
+}
+
+// Measured duration of the last sector erase and page program.
+uint32_t savecache_erase_us(void)
+{
+    return OpMeasuredUs[SAVECACHE_OP_ERASE_SECTOR];
+}
+
+uint32_t savecache_program_us(void)
+{
+    return OpMeasuredUs[SAVECACHE_OP_PROGRAM];
+}
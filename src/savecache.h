@@ -0,0 +1,50 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * SaveCache
+ * RAM shadow of the cart save, the host reads and writes the shadow and core1 writes dirty pages back.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SAVECACHE_SIZE        (128 * 1024)
+#define SAVECACHE_PAGE_SIZE   (128)
+#define SAVECACHE_SECTOR_SIZE (512)
+
+// Dirty pages are written back once the host stopped writing for SAVECACHE_IDLE_MS, at the latest
+// SAVECACHE_TIMEOUT_MS after the first page got dirty, or right away on eject.
+#define SAVECACHE_IDLE_MS     (500)
+#define SAVECACHE_TIMEOUT_MS  (5000)
+
+#define SAVECACHE_NO_POLL     (0xFFFFFFFF)
+
+enum SAVE_TYPE {
+    SAVE_TYPE_NONE = 0,
+    SAVE_TYPE_FLASHRAM,
+    SAVE_TYPE_SRAM,
+};
+
+void savecache_init(void);
+void savecache_read(uint32_t offset, uint8_t *buffer, bool flip);
+void savecache_write(uint32_t offset, const uint8_t *buffer, bool flip);
+void savecache_flush(void);
+bool savecache_step(void);
+uint32_t savecache_poll_us(void);
+uint32_t savecache_erase_us(void);
+uint32_t savecache_program_us(void);
+
+extern enum SAVE_TYPE gSaveType;
+extern uint32_t gSaveSize;
+
+// Statistics of the last write-back, programs counts FlashRAM pages or SRAM halfword runs, rewrites the SRAM runs
+// the verify had to write again.
+extern uint32_t gSaveWriteBacks;
+extern uint32_t gSaveErases;
+extern uint32_t gSavePrograms;
+extern uint32_t gSaveRewrites;
+extern bool gSaveChipErased;
+extern uint32_t gSaveWriteBackMs;
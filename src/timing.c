@@ -0,0 +1,43 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Timing
+ * Sets the system clock and converts bus timings and PIO clocks for whatever clk_sys ended up being.
+ */
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/vreg.h"
+#include "timing.h"
+
+uint32_t gSysClockHz = 125000000;
+uint32_t gBootPhaseUs[BOOT_PHASE_COUNT];
+
+void timing_init(void)
+{
+#ifdef DRMDMP_OVERCLOCK
+    // Raise the core voltage first and give it time to settle before the PLL is pushed up.
+    vreg_set_voltage(OVERCLOCK_VREG);
+    busy_wait_us(10 * 1000);
+    set_sys_clock_khz(OVERCLOCK_SYS_KHZ, true);
+#endif
+
+    gSysClockHz = clock_get_hz(clk_sys);
+}
+
+// Rounds up, a delay should never end up shorter than asked for.
+uint32_t timing_ns_to_cycles(uint32_t ns)
+{
+    return (uint32_t)((((uint64_t)ns * gSysClockHz) + 999999999u) / 1000000000u);
+}
+
+float timing_pio_clkdiv(uint32_t pio_hz)
+{
+    return (float)gSysClockHz / (float)pio_hz;
+}
+
+void timing_boot_phase(uint32_t phase)
+{
+    gBootPhaseUs[phase] = time_us_32();
+}
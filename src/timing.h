@@ -0,0 +1,38 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Timing
+ * Sets the system clock and converts bus timings and PIO clocks for whatever clk_sys ended up being.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Overclock profile, enabled with -DDRMDMP_OVERCLOCK=ON.
+// 250MHz is stable with the core voltage raised to 1.20V, the QSPI flash runs at clk_sys / 2 = 125MHz.
+#define OVERCLOCK_SYS_KHZ (250000)
+#define OVERCLOCK_VREG    (VREG_VOLTAGE_1_20)
+
+// Boot progress, each phase records the time since boot at which it completed.
+enum BOOT_PHASE {
+    BOOT_PHASE_USB = 0,
+    BOOT_PHASE_RESET,
+    BOOT_PHASE_HEADER,
+    BOOT_PHASE_CALIBRATE,
+    BOOT_PHASE_PROBE,
+    BOOT_PHASE_EEPROM,
+    BOOT_PHASE_CART,
+    BOOT_PHASE_READY,
+    BOOT_PHASE_MOUNTED,
+    BOOT_PHASE_COUNT,
+};
+
+void timing_init(void);
+void timing_boot_phase(uint32_t phase);
+uint32_t timing_ns_to_cycles(uint32_t ns);
+float timing_pio_clkdiv(uint32_t pio_hz);
+
+extern uint32_t gSysClockHz;
+extern uint32_t gBootPhaseUs[BOOT_PHASE_COUNT];
@@ -97,7 +97,7 @@
 #define CFG_TUD_MIDI             0
 #define CFG_TUD_VENDOR           0
 
-#define BUFFER_MULTIPLIER 1
+#define BUFFER_MULTIPLIER 8
 // CDC FIFO size of TX and RX
 #define CFG_TUD_CDC_RX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? (512 * BUFFER_MULTIPLIER) : 64)
 #define CFG_TUD_CDC_TX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? (512 * BUFFER_MULTIPLIER) : 64)
@@ -105,7 +105,7 @@
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE   (TUD_OPT_HIGH_SPEED ? (512 * BUFFER_MULTIPLIER) : 64)
 
-// MSC Buffer size of Device Mass storage
+// MSC Buffer size of Device Mass storage, 4KB lets a read10/write10 callback serve 8 sectors at once.
 #define CFG_TUD_MSC_EP_BUFSIZE   (512 * BUFFER_MULTIPLIER)
 
 #ifdef __cplusplus
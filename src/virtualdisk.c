@@ -13,17 +13,30 @@
 #include "bsp/board.h"
 #include "tusb.h"
 #include "n64cartinterface.h"
+#include "cartbus.h"
+#include "timing.h"
+#include "romcache.h"
+#include "prefetch.h"
+#include "flashcache.h"
+#include "romhash.h"
+#include "savecache.h"
 
 #if CFG_TUD_MSC
 
 // whether host does safe-eject
 static bool ejected = false;
 
-#define CLUSTER_UP_SHIFT 0u
-#define CLUSTER_UP_MUL (1u << CLUSTER_UP_SHIFT)
-#define VOLUME_SIZE (CLUSTER_UP_MUL * 256u * 1024u * 1024u)
+// whether layout and metadata sectors are rendered for the probed cart
+static bool DiskLayoutReady = false;
+
+// Geometry for the probed cart, set with the layout. Sectors per cluster as a shift, the sector count covers the
+// whole disk including the MBR.
+static uint32_t ClusterShift = 0;
+static uint32_t SectorCount = 0;
+
+static bool vd_layout_ready(void);
+
 #define SECTOR_SIZE 512u
-#define SECTOR_COUNT (VOLUME_SIZE / SECTOR_SIZE)
 
 uint8_t CartTestText[2 * 1024] = 
 "\nCart tester report:\n\n"
@@ -36,10 +49,8 @@ uint8_t CartTestText[2 * 1024] =
 "    RomID     - 00000000\n"
 "    RomRegion - Europe\n";
 
-#define vd_sector_count() SECTOR_COUNT
 enum
 {
-  DISK_BLOCK_NUM  = SECTOR_COUNT, // 8KB is the smallest size that windows allow to mount
   DISK_BLOCK_SIZE = 512
 };
 
@@ -47,22 +58,20 @@ enum
 #define RASPBERRY_PI_TIME_FRAC 100
 #define RASPBERRY_PI_TIME ((16u << 11u) | (20u << 5u) | (51u >> 1u))
 #define RASPBERRY_PI_DATE ((28u << 9u) | (9u << 5u) | (5u))
-//#define NO_PARTITION_TABLE
 
-#define CLUSTER_SIZE (32768u * CLUSTER_UP_MUL)
-#define CLUSTER_SHIFT (6u + CLUSTER_UP_SHIFT)
+// The volume always has VOLUME_CLUSTER_COUNT clusters, enough for both views of the largest ROM at the largest cluster
+// size plus room for the small files. The cluster size is picked at runtime as the smallest that fits the probed cart,
+// so the volume stays within about twice the size of its files and the FAT is the same handful of sectors for every cart.
+#define ROM_MAX_SIZE (64 * 1024 * 1024)
+#define CLUSTER_MAX_SIZE 32768u
+#define CLUSTER_MAX_SHIFT 6u
 
-static_assert(CLUSTER_SIZE == SECTOR_SIZE << CLUSTER_SHIFT, "");
+static_assert(CLUSTER_MAX_SIZE == SECTOR_SIZE << CLUSTER_MAX_SHIFT, "");
 
-#define CLUSTER_COUNT (VOLUME_SIZE / CLUSTER_SIZE)
+#define VOLUME_CLUSTER_COUNT ((2 * (ROM_MAX_SIZE / CLUSTER_MAX_SIZE)) + 64)
 
-static_assert(CLUSTER_COUNT <= 65526, "FAT16 limit");
-
-#ifdef NO_PARTITION_TABLE
-#define VOLUME_SECTOR_COUNT SECTOR_COUNT
-#else
-#define VOLUME_SECTOR_COUNT (SECTOR_COUNT-1)
-#endif
+static_assert(VOLUME_CLUSTER_COUNT >= 4085, "below 4085 clusters hosts treat the volume as FAT12");
+static_assert(VOLUME_CLUSTER_COUNT <= 65524, "FAT16 limit");
 
 #define FAT_COUNT 2u
 #define MAX_ROOT_DIRECTORY_ENTRIES 512
@@ -71,10 +80,16 @@ static_assert(CLUSTER_COUNT <= 65526, "FAT16 limit");
 #define lsb_hword(x) (((uint)(x)) & 0xffu), ((((uint)(x))>>8u)&0xffu)
 #define lsb_word(x) (((uint)(x)) & 0xffu), ((((uint)(x))>>8u)&0xffu),  ((((uint)(x))>>16u)&0xffu),  ((((uint)(x))>>24u)&0xffu)
 
-#define SECTORS_PER_FAT (2 * (CLUSTER_COUNT + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define SECTORS_PER_FAT ((((2 + VOLUME_CLUSTER_COUNT) * 2) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+// MBR and boot sector come first, then the FATs, the root directory and the data area.
+#define VOLUME_LBA 1u
+#define FAT_LBA 2u
+#define ROOT_DIRECTORY_LBA (FAT_LBA + (SECTORS_PER_FAT * FAT_COUNT))
+#define DATA_LBA (ROOT_DIRECTORY_LBA + ROOT_DIRECTORY_SECTORS)
+#define SECTOR_COUNT_MAX (DATA_LBA + (VOLUME_CLUSTER_COUNT << CLUSTER_MAX_SHIFT))
 static_assert(SECTORS_PER_FAT < 65536, "");
-
-static_assert(VOLUME_SIZE >= 16 * 1024 * 1024, "volume too small for fat16");
+// The partition table entry only has room for a 24 bit sector count.
+static_assert(!((SECTOR_COUNT_MAX - 1u) >> 24), "");
 
 // we are a hard drive - SCSI inquiry defines removability
 #define IS_REMOVABLE_MEDIA false
@@ -94,20 +109,16 @@ static const uint8_t boot_sector[] = {
 //        'U', 'F', '2', ' ', 'U', 'F', '2', ' ',
         // 0b bytes per sector
         lsb_hword(512),
-        // 0d sectors per cluster
-        (CLUSTER_SIZE / SECTOR_SIZE),
+        // 0d sectors per cluster, set for the probed cart
+        0,
         // 0e reserved sectors
         lsb_hword(1),
         // 10 fat count
         FAT_COUNT,
         // 11 max number root entries
         lsb_hword(MAX_ROOT_DIRECTORY_ENTRIES),
-        // 13 number of sectors, if < 32768
-#if VOLUME_SECTOR_COUNT < 65536
-        lsb_hword(VOLUME_SECTOR_COUNT),
-#else
+        // 13 number of sectors, if < 65536, set for the probed cart
         lsb_hword(0),
-#endif
         // 15 media descriptor
         MEDIA_TYPE,
         // 16 sectors per FAT
@@ -117,13 +128,9 @@ static const uint8_t boot_sector[] = {
         // 1a heads (non LBA)
         lsb_hword(1),
         // 1c hidden sectors 1 for MBR
-        lsb_word(SECTOR_COUNT - VOLUME_SECTOR_COUNT),
-// 20 sectors if >32K
-#if VOLUME_SECTOR_COUNT >= 65536
-        lsb_word(VOLUME_SECTOR_COUNT),
-#else
+        lsb_word(VOLUME_LBA),
+        // 20 sectors if >= 65536, set for the probed cart
         lsb_word(0),
-#endif
         // 24 drive number
         0,
         // 25 reserved (seems to be chkdsk flag for clean unmount - linux writes 1)
@@ -139,6 +146,9 @@ static const uint8_t boot_sector[] = {
 };
 static_assert(sizeof(boot_sector) == 0x40, "");
 
+#define BOOT_OFFSET_SECTORS_PER_CLUSTER 0x0d
+#define BOOT_OFFSET_SECTOR_COUNT16 0x13
+#define BOOT_OFFSET_SECTOR_COUNT32 0x20
 #define BOOT_OFFSET_SERIAL_NUMBER 0x27
 #define BOOT_OFFSET_LABEL 0x2b
 
@@ -149,16 +159,9 @@ static_assert(sizeof(boot_sector) == 0x40, "");
 #define ATTR_DIR            0x10u
 #define ATTR_ARCHIVE        0x20u
 
-#define EEPROM_SIZE (32 * 1024)
-#define EEPROM_CLUSTER_START 0
 #define FLASHRAM_SIZE (128 * 1024)
-#define FLASHRAM_CLUSTER_START (EEPROM_CLUSTER_START + (EEPROM_SIZE / CLUSTER_SIZE))
-#define N64ROM_SIZE (64 * 1024 * 1024)
-#define N64ROM_CLUSTER_START (FLASHRAM_CLUSTER_START + (FLASHRAM_SIZE / CLUSTER_SIZE))
-#define Z64ROM_CLUSTER_START (N64ROM_CLUSTER_START + (N64ROM_SIZE / CLUSTER_SIZE))
-#define FLASHRAMFLIP_CLUSTER_START (Z64ROM_CLUSTER_START + (N64ROM_SIZE / CLUSTER_SIZE))
-#define EEPROMFLIP_CLUSTER_START (FLASHRAMFLIP_CLUSTER_START + (FLASHRAM_SIZE / CLUSTER_SIZE))
-#define CARTTEST_CLUSTER_START (EEPROMFLIP_CLUSTER_START + (EEPROM_SIZE / CLUSTER_SIZE))
+#define CARTTEST_SIZE (2 * 1024)
+#define HASHES_SIZE SECTOR_SIZE
 
 #define MBR_OFFSET_SERIAL_NUMBER 0x1b8
 
@@ -213,6 +216,21 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
 {
   (void) lun;
 
+  // No cart answered the probe, core1 has given up on it. Report the medium as not present instead of
+  // becoming ready forever, so the host stops retrying.
+  if (gCartMissing != false) {
+    // Additional Sense 3A-00 is MEDIUM NOT PRESENT
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
+    return false;
+  }
+
+  // Core1 is still probing the cart, ask the host to retry.
+  if (gCartReady == false) {
+    // Additional Sense 04-01 is LOGICAL UNIT IS IN PROCESS OF BECOMING READY
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);
+    return false;
+  }
+
   // RAM disk is ready until ejected
   if (ejected) {
     // Additional Sense 3A-00 is NOT_FOUND
@@ -229,7 +247,8 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_siz
 {
   (void) lun;
 
-  *block_count = DISK_BLOCK_NUM;
+  // The geometry follows the probed cart, a count of 0 reports the medium as not present until then.
+  *block_count = (vd_layout_ready() != false) ? SectorCount : 0;
   *block_size  = DISK_BLOCK_SIZE;
 }
 
@@ -245,10 +264,12 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
   {
     if (start)
     {
-      // load disk storage
+      // load disk storage, render the metadata again on the next access
+      DiskLayoutReady = false;
     }else
     {
-      // unload disk storage
+      // unload disk storage, write the cached save back right away
+      savecache_flush();
       ejected = true;
     }
   }
@@ -314,289 +335,484 @@ uint32_t msc_get_serial_number32() {
 }
 
 #define min(x, y) (x < y ? x : y)
-static volatile uint32_t lock = 0;
+#define max(x, y) (x > y ? x : y)
+
+// A file on the volume. The layout gives each region with a non zero size whole clusters after the previous one,
+// FAT chains, directory entries and the sector lookup all come from this table.
+typedef struct _DiskRegion
+{
+    const char *Name;                 // 8.3 name without the dot, upper case
+    const char *LongName;             // UTF-16, 13 characters
+    uint8_t Attribute;
+    bool Flip;                        // Byteflipped view of the same data
+    uint32_t (*Size)(void);           // File size for the probed cart, 0 leaves the file out
+    // Serve sectors from Offset on, Length is at least a sector and never crosses the end of the region.
+    // Returns the number of bytes written to Buffer, 0 while the data is not there yet.
+    uint32_t (*Read)(const struct _DiskRegion *Region, uint32_t Offset, uint8_t *Buffer, uint32_t Length);
+    void (*Write)(const struct _DiskRegion *Region, uint32_t Offset, const uint8_t *Buffer);
+} DiskRegion;
+
+typedef struct _DiskExtent
+{
+    const DiskRegion *Region;
+    uint32_t Cluster;                 // First cluster counted from the start of the data area
+    uint32_t Clusters;
+    uint32_t Size;
+} DiskExtent;
+
+static uint32_t region_size_eeprom(void)
+{
+    return gEepromSize;
+}
+
+// DaisyDrive64 doesn't differentiate between SRAM and FRAM for filenames, the flipped views do for Ares.
+static uint32_t region_size_save(void)
+{
+    return ((gSRAMPresent != false) || (gFramPresent != false)) ? FLASHRAM_SIZE : 0;
+}
+
+static uint32_t region_size_flashram(void)
+{
+    return (gFramPresent != false) ? FLASHRAM_SIZE : 0;
+}
+
+static uint32_t region_size_sram(void)
+{
+    return ((gSRAMPresent != false) && (gFramPresent == false)) ? FLASHRAM_SIZE : 0;
+}
+
+static uint32_t region_size_rom(void)
+{
+    return gRomSize;
+}
+
+static uint32_t region_size_carttest(void)
+{
+    return CARTTEST_SIZE;
+}
+
+static uint32_t region_size_hashes(void)
+{
+    return HASHES_SIZE;
+}
+
+static uint32_t region_read_eeprom(const DiskRegion *Region, uint32_t Offset, uint8_t *Buffer, uint32_t Length)
+{
+    (void)Length;
+    ReadEepromShadow(Offset, Buffer, Region->Flip);
+    return SECTOR_SIZE;
+}
+
+static void region_write_eeprom(const DiskRegion *Region, uint32_t Offset, const uint8_t *Buffer)
+{
+    WriteEepromShadow(Offset, Buffer, Region->Flip);
+}
+
+// SRAM/FRAM through the save cache, Dezaemon's banked SRAM shows up as its three banks one after the other.
+static uint32_t region_read_save(const DiskRegion *Region, uint32_t Offset, uint8_t *Buffer, uint32_t Length)
+{
+    (void)Length;
+    savecache_read(Offset, Buffer, Region->Flip);
+    return SECTOR_SIZE;
+}
+
+static void region_write_save(const DiskRegion *Region, uint32_t Offset, const uint8_t *Buffer)
+{
+    savecache_write(Offset, Buffer, Region->Flip);
+}
+
+// ROM reads never wait on the bus, 0 is returned while core1 is still fetching the data.
+static uint32_t region_read_rom(const DiskRegion *Region, uint32_t Offset, uint8_t *Buffer, uint32_t Length)
+{
+    uint32_t Address = CART_ADDRESS_START + Offset;
+    if (romcache_try_read(Address, (uint16_t*)Buffer, Length, Region->Flip) == false) {
+        prefetch_request(Address, Length);
+        return 0;
+    }
+
+    prefetch_notify(Address, Length);
+    return Length;
+}
+
+// The report outgrew a sector and carries live statistics. It is rendered when the host reads the first sector,
+// the following sectors are served from that render so a read of the file sees one consistent report.
+static uint32_t region_read_carttest(const DiskRegion *Region, uint32_t Offset, uint8_t *Buffer, uint32_t Length)
+{
+    (void)Region;
+    (void)Length;
+    static char Report[CARTTEST_SIZE];
+    static bool ReportRendered = false;
+    if (Offset >= CARTTEST_SIZE) {
+        memset(Buffer, 0, SECTOR_SIZE);
+        return SECTOR_SIZE;
+    }
+
+    if ((Offset != 0) && (ReportRendered != false)) {
+        memcpy(Buffer, Report + Offset, SECTOR_SIZE);
+        return SECTOR_SIZE;
+    }
+
+    const char* NotPresent = "Not present";
+    const char* Failed = "Failed";
+    const char* OK = "OK!";
+    const char* PAL = "PAL";
+    const char* NTSC = "NTSC";
+    const char* EepString = Failed;
+    const char* CICString = Failed;
+    if (gEepromSize == 0) {
+      EepString = NotPresent;
+    } else if (gEepromSize == 0x200) {
+      EepString = "4K OK!";
+    } else if (gEepromSize == 0x800) {
+      EepString = "16K OK!";
+    }
+    if (gCICType == CIC_TYPE_INVALID) {
+      CICString = Failed;
+    } else if (gCICType == CIC_TYPE_PAL) {
+      CICString = PAL;
+    } else if (gCICType == CIC_TYPE_NTSC) {
+      CICString = NTSC;
+    }
+    const char* SaveString = "Off";
+    if (gSaveType == SAVE_TYPE_FLASHRAM) {
+      SaveString = "FlashRam";
+    } else if (gSaveType == SAVE_TYPE_SRAM) {
+      SaveString = "SRAM";
+    }
+
+    memset(Report, 0, sizeof(Report));
+    snprintf(Report, sizeof(Report),
+    "\nCart tester report:\n\n"
+    "    EEPROM     - %s\n"
+    "    SRAM       - %s\n"
+    "    FlashRam   - %s (%02X)\n"
+    "    CIC        - %s %s\n"
+    "    Romsize    - %luMB (probed in %luus)\n"
+    "    RomName    - %s\n"
+    "    RomID      - %04X %c%c\n"
+    "    CartType   - %c\n"
+    "    RomRegion  - %c\n"
+    "    RomVersion - %02X\n"
+    "    BusTiming  - Latch %luns Read %lu/%luns @ %luMHz (%s)\n"
+    "    RomCache   - %lu hits %lu misses\n"
+    "    Prefetch   - %lu of %lu blocks used, depth %u\n"
+    "    FlashCache - %lu of %lu blocks stored, %lu hits (%s)\n"
+    "    EEPROMSave - %lu blocks written in %lums, %lu failed\n"
+    "    SaveCache  - %s, write-back #%lu: %lu erases%s %lu programs (%lu rewritten) in %lums\n"
+    "                 Sector erase %luus Page program %luus\n"
+    "    Boot       - USB %lums Header %lums Calibrated %lums Probed %lums EEPROM %lums\n"
+    "                 Cart %lums Ready %lums Mounted %lums\n",
+    EepString,
+    (gSRAMPresent != 0) ? ((gSRAMBanked != false) ? "OK! (3 banks, 96KB)" : OK) : NotPresent,
+    (gFramPresent != 0) ? OK : NotPresent, gFlashType,
+    CICString,
+    gCICName,
+    (gRomSize / (1024 * 1024)), gRomSizeProbeUs,
+    (char*)gGameTitle,
+    gGameCode[1], ((gGameCode[1] >> 8) & 0xFF), (gGameCode[1] & 0xFF),
+    gGameCode[0] & 0xFF,
+    ((gGameCode[2] >> 8) & 0xFF),
+    (gGameCode[2] & 0xFF),
+    gCartBusTiming.LatchNs, gCartBusTiming.ReadLowNs, gCartBusTiming.ReadHighNs, (gSysClockHz / 1000000),
+    (gCartBusCalibrated != false) ? "Tuned" : "Default",
+    gRomCacheHits, gRomCacheMisses,
+    gRomCachePrefetchHits, gPrefetchIssued, PREFETCH_DEPTH,
+    gFlashCacheStored, (gRomSize / ROMCACHE_BLOCK_SIZE), gFlashCacheHits,
+    (gFlashCacheAttached != false) ? "On" : "Off",
+    gEepromBlocksWritten, (gEepromWriteUs / 1000), gEepromWriteErrors,
+    SaveString, gSaveWriteBacks, gSaveErases,
+    (gSaveChipErased != false) ? " (chip)" : "", gSavePrograms, gSaveRewrites, gSaveWriteBackMs,
+    savecache_erase_us(), savecache_program_us(),
+    (gBootPhaseUs[BOOT_PHASE_USB] / 1000), (gBootPhaseUs[BOOT_PHASE_HEADER] / 1000),
+    (gBootPhaseUs[BOOT_PHASE_CALIBRATE] / 1000), (gBootPhaseUs[BOOT_PHASE_PROBE] / 1000),
+    (gBootPhaseUs[BOOT_PHASE_EEPROM] / 1000), (gBootPhaseUs[BOOT_PHASE_CART] / 1000),
+    (gBootPhaseUs[BOOT_PHASE_READY] / 1000), (gBootPhaseUs[BOOT_PHASE_MOUNTED] / 1000)
+    );
+    ReportRendered = true;
+    memcpy(Buffer, Report + Offset, SECTOR_SIZE);
+    return SECTOR_SIZE;
+}
+
+static uint32_t region_read_hashes(const DiskRegion *Region, uint32_t Offset, uint8_t *Buffer, uint32_t Length)
+{
+    (void)Region;
+    (void)Length;
+    memset(Buffer, 0, SECTOR_SIZE);
+    if (Offset == 0) {
+        romhash_report((char*)Buffer, SECTOR_SIZE);
+    }
+
+    return SECTOR_SIZE;
+}
+
+// Do not use lower case letters in the 8.3 names, windows will show the file but it won't be able to "find" the data for the file.
+static const DiskRegion DiskRegions[] = {
+    { "ROM     EEP", "R\0O\0M\0.\0e\0e\0p\0\0\0\0\0\0\0\0\0\0", 0, false,
+      region_size_eeprom, region_read_eeprom, region_write_eeprom },
+    { "ROM     FLA", "R\0O\0M\0.\0f\0l\0a\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 0, false,
+      region_size_save, region_read_save, region_write_save },
+    { "ROM     N64", "R\0O\0M\0.\0n\0""6\0""4\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", ATTR_READONLY, false,
+      region_size_rom, region_read_rom, NULL },
+    { "ROMF    Z64", "R\0O\0M\0F\0.\0z\0""6\0""4\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", ATTR_READONLY, true,
+      region_size_rom, region_read_rom, NULL },
+    { "ROMF    FLA", "R\0O\0M\0F\0.\0f\0l\0a\0s\0h\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 0, true,
+      region_size_flashram, region_read_save, region_write_save },
+    { "ROMF    RAM", "R\0O\0M\0F\0.\0r\0a\0m\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 0, true,
+      region_size_sram, region_read_save, region_write_save },
+    { "ROMF    EEP", "R\0O\0M\0F\0.\0e\0e\0p\0r\0o\0m\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 0, true,
+      region_size_eeprom, region_read_eeprom, region_write_eeprom },
+    { "CARTTESTTXT", "C\0a\0r\0t\0T\0e\0s\0t\0.\0t\0x\0t\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", ATTR_READONLY, false,
+      region_size_carttest, region_read_carttest, NULL },
+    { "HASHES  TXT", "H\0a\0s\0h\0e\0s\0.\0t\0x\0t\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", ATTR_READONLY, false,
+      region_size_hashes, region_read_hashes, NULL },
+};
+
+#define DISK_REGION_COUNT (sizeof(DiskRegions) / sizeof(DiskRegions[0]))
+
+// Volume label plus a long and a short name entry per region.
+#define ROOT_DIRECTORY_USED_SECTORS 2u
+static_assert((1 + (2 * DISK_REGION_COUNT)) <= (ROOT_DIRECTORY_USED_SECTORS * SECTOR_SIZE / sizeof(struct dir_entry)), "");
+
+static DiskExtent DiskExtents[DISK_REGION_COUNT];
+static uint32_t DiskExtentCount = 0;
+
+// Metadata sectors rendered once and served with a memcpy, hosts read them over and over while mounting and listing.
+static uint8_t BootSectors[2][SECTOR_SIZE];
+static uint8_t FatSectors[SECTORS_PER_FAT][SECTOR_SIZE];
+static struct dir_entry RootDirectory[ROOT_DIRECTORY_USED_SECTORS * (SECTOR_SIZE / sizeof(struct dir_entry))];
+
+static uint32_t vd_count_clusters(uint32_t Shift)
+{
+    uint32_t ClusterSize = SECTOR_SIZE << Shift;
+    uint32_t Clusters = 0;
+    for (uint32_t i = 0; i < DISK_REGION_COUNT; i += 1) {
+        Clusters += (DiskRegions[i].Size() + ClusterSize - 1) / ClusterSize;
+    }
+
+    return Clusters;
+}
+
+// Lay the regions out for the probed cart, the ROM views take as many clusters as the ROM has.
+// The smallest cluster size that fits all regions sets the size of the volume.
+static void vd_build_layout(void)
+{
+    ClusterShift = 0;
+    while ((ClusterShift < CLUSTER_MAX_SHIFT) && (vd_count_clusters(ClusterShift) > VOLUME_CLUSTER_COUNT)) {
+        ClusterShift += 1;
+    }
+
+    SectorCount = DATA_LBA + (VOLUME_CLUSTER_COUNT << ClusterShift);
+
+    uint32_t ClusterSize = SECTOR_SIZE << ClusterShift;
+    uint32_t Cluster = 0;
+    DiskExtentCount = 0;
+    for (uint32_t i = 0; i < DISK_REGION_COUNT; i += 1) {
+        uint32_t Size = DiskRegions[i].Size();
+        uint32_t Clusters = (Size + ClusterSize - 1) / ClusterSize;
+        if ((Size == 0) || ((Cluster + Clusters) > VOLUME_CLUSTER_COUNT)) {
+            continue;
+        }
+
+        DiskExtent *Extent = &DiskExtents[DiskExtentCount];
+        Extent->Region = &DiskRegions[i];
+        Extent->Cluster = Cluster;
+        Extent->Clusters = Clusters;
+        Extent->Size = Size;
+        DiskExtentCount += 1;
+        Cluster += Clusters;
+    }
+}
+
+// Binary search over the extents, they are sorted by cluster. NULL for clusters past the last file.
+static const DiskExtent *vd_find_extent(uint32_t Cluster)
+{
+    uint32_t Low = 0;
+    uint32_t High = DiskExtentCount;
+    while (Low < High) {
+        uint32_t Mid = (Low + High) / 2;
+        const DiskExtent *Extent = &DiskExtents[Mid];
+        if (Cluster < Extent->Cluster) {
+            High = Mid;
+        } else if (Cluster >= (Extent->Cluster + Extent->Clusters)) {
+            Low = Mid + 1;
+        } else {
+            return Extent;
+        }
+    }
+
+    return NULL;
+}
+
+// The one partition, the volume starts right after the MBR. The sector count always fits 24 bits.
+static void vd_partition_entry(uint8_t *ptable)
+{
+    uint32_t VolumeSectors = SectorCount - VOLUME_LBA;
+    const uint8_t _ptable_data4[] = {
+            PT_FAT16_LBA, 0, 0, 0,
+            lsb_word(VOLUME_LBA),
+            // sector count, but we know the MS byte is zero
+            VolumeSectors & 0xffu,
+            (VolumeSectors >> 8u) & 0xffu,
+            (VolumeSectors >> 16u) & 0xffu,
+    };
+    memcpy(ptable + 4, _ptable_data4, sizeof(_ptable_data4));
+}
+
+static void vd_render_mbr(uint8_t *buf)
+{
+    memset(buf, 0, SECTOR_SIZE);
+    uint8_t *ptable = buf + SECTOR_SIZE - 2 - 64;
+    vd_partition_entry(ptable);
+    ptable[64] = 0x55;
+    ptable[65] = 0xaa;
+
+    uint32_t sn = msc_get_serial_number32();
+    memcpy(buf + MBR_OFFSET_SERIAL_NUMBER, &sn, 4);
+}
+
+static void vd_render_boot_sector(uint8_t *buf)
+{
+    memset(buf, 0, SECTOR_SIZE);
+    uint32_t sn = msc_get_serial_number32();
+    memcpy(buf, boot_sector, sizeof(boot_sector));
+    memcpy(buf + BOOT_OFFSET_SERIAL_NUMBER, &sn, 4);
+
+    uint32_t VolumeSectors = SectorCount - VOLUME_LBA;
+    buf[BOOT_OFFSET_SECTORS_PER_CLUSTER] = (uint8_t)(1u << ClusterShift);
+    if (VolumeSectors < 65536) {
+        buf[BOOT_OFFSET_SECTOR_COUNT16] = (uint8_t)VolumeSectors;
+        buf[BOOT_OFFSET_SECTOR_COUNT16 + 1] = (uint8_t)(VolumeSectors >> 8);
+    } else {
+        memcpy(buf + BOOT_OFFSET_SECTOR_COUNT32, &VolumeSectors, 4);
+    }
+
+    uint8_t *ptable = buf + SECTOR_SIZE - 2 - 64;
+    vd_partition_entry(ptable);
+
+    ptable[64] = 0x55;
+    ptable[65] = 0xaa;
+
+    memcpy(buf + MBR_OFFSET_SERIAL_NUMBER, &sn, 4);
+}
+
+// One sector of the FAT. FAT cluster numbers start at 2 for the first cluster of the data area.
+static void vd_render_fat_sector(uint32_t Sector, uint8_t *Buffer)
+{
+    uint16_t *Entries = (uint16_t*)Buffer;
+    uint32_t First = Sector * (SECTOR_SIZE / sizeof(uint16_t));
+    uint32_t Last = First + (SECTOR_SIZE / sizeof(uint16_t));
+
+    memset(Buffer, 0, SECTOR_SIZE);
+    if (Sector == 0) {
+        Entries[0] = 0xff00u | MEDIA_TYPE;
+        Entries[1] = 0xffff;
+    }
+
+    for (uint32_t i = 0; i < DiskExtentCount; i += 1) {
+        uint32_t Start = DiskExtents[i].Cluster + 2;
+        uint32_t End = Start + DiskExtents[i].Clusters;
+        for (uint32_t Cluster = max(Start, First); Cluster < min(End, Last); Cluster += 1) {
+            Entries[Cluster - First] = (Cluster == (End - 1)) ? 0xffff : (uint16_t)(Cluster + 1);
+        }
+    }
+}
+
+static void vd_render_root_directory(void)
+{
+    memset(RootDirectory, 0, sizeof(RootDirectory));
+    struct dir_entry *entries = RootDirectory;
+    memcpy(entries[0].name, (boot_sector + BOOT_OFFSET_LABEL), 11);
+    entries[0].attr = ATTR_VOLUME_LABEL | ATTR_ARCHIVE;
+    for (uint32_t i = 0; i < DiskExtentCount; i += 1) {
+        const DiskExtent *Extent = &DiskExtents[i];
+        init_dir_entry(++entries, Extent->Region->Name, Extent->Region->LongName, Extent->Cluster + 2, Extent->Size,
+                       Extent->Region->Attribute);
+        entries++;
+    }
+}
+
+// The geometry, layout and all metadata sectors need the probe results and are rendered the first time the cart
+// reads ready.
+// The cart state they depend on doesn't change after that, a new load of the medium renders them again.
+static bool vd_layout_ready(void)
+{
+    if (DiskLayoutReady == false) {
+        if (gCartReady == false) {
+            return false;
+        }
+
+        vd_build_layout();
+        vd_render_mbr(BootSectors[0]);
+        vd_render_boot_sector(BootSectors[1]);
+        for (uint32_t i = 0; i < SECTORS_PER_FAT; i += 1) {
+            vd_render_fat_sector(i, FatSectors[i]);
+        }
+
+        vd_render_root_directory();
+        DiskLayoutReady = true;
+    }
+
+    return true;
+}
+
+// Serve as many sectors from lba on as belong to the same region, returns the number of bytes written to buf.
+// Metadata, save and EEPROM regions are served a sector at a time, the ROM regions in one go.
+static uint32_t read10_run(uint32_t lba, uint8_t *buf, uint32_t buf_size)
+{
+    if (lba < FAT_LBA) {
+        memcpy(buf, BootSectors[lba], SECTOR_SIZE);
+    } else if (lba < ROOT_DIRECTORY_LBA) {
+        // mirror
+        memcpy(buf, FatSectors[(lba - FAT_LBA) % SECTORS_PER_FAT], SECTOR_SIZE);
+    } else if (lba < DATA_LBA) {
+        // we don't support that many directory entries actually
+        uint32_t Sector = lba - ROOT_DIRECTORY_LBA;
+        if (Sector < ROOT_DIRECTORY_USED_SECTORS) {
+            memcpy(buf, ((const uint8_t*)RootDirectory) + (Sector * SECTOR_SIZE), SECTOR_SIZE);
+        } else {
+            memset(buf, 0, SECTOR_SIZE);
+        }
+    } else {
+        lba -= DATA_LBA;
+        const DiskExtent *Extent = vd_find_extent(lba >> ClusterShift);
+        if (Extent == NULL) {
+            memset(buf, 0, SECTOR_SIZE);
+        } else {
+            uint32_t Offset = (lba - (Extent->Cluster << ClusterShift)) * SECTOR_SIZE;
+            uint32_t Length = min(buf_size, ((Extent->Clusters << ClusterShift) * SECTOR_SIZE) - Offset);
+            return Extent->Region->Read(Extent->Region, Offset, buf, Length);
+        }
+    }
+
+    return SECTOR_SIZE;
+}
+
+// Invoked when received SCSI_CMD_READ10 command, buf_size can span several sectors and regions.
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buf, uint32_t buf_size)
 {
     (void)lun;
     (void)offset;
     assert(offset == 0);
-    
-    if (!lba) {
-        memset(buf, 0, buf_size);
-        uint8_t *ptable = buf + SECTOR_SIZE - 2 - 64;
-        static_assert(!((SECTOR_COUNT - 1u) >> 24), "");
-        static const uint8_t _ptable_data4[] = {
-                PT_FAT16_LBA, 0, 0, 0,
-                lsb_word(1), // sector 1
-                // sector count, but we know the MS byte is zero
-                (SECTOR_COUNT - 1u) & 0xffu,
-                ((SECTOR_COUNT - 1u) >> 8u) & 0xffu,
-                ((SECTOR_COUNT - 1u) >> 16u) & 0xffu,
-        };
-        memcpy(ptable + 4, _ptable_data4, sizeof(_ptable_data4));
-        ptable[64] = 0x55;
-        ptable[65] = 0xaa;
-
-        uint32_t sn = msc_get_serial_number32();
-        memcpy(buf + MBR_OFFSET_SERIAL_NUMBER, &sn, 4);
-        lock = 0;
-        return (int32_t)512;
-    }
-    lba--;
-
-    if (!lba) {
-        memset(buf, 0, buf_size);
-        uint32_t sn = msc_get_serial_number32();
-        memcpy(buf, boot_sector, sizeof(boot_sector));
-        memcpy(buf + BOOT_OFFSET_SERIAL_NUMBER, &sn, 4);
-
-        static_assert(!((SECTOR_COUNT - 1u) >> 24), "");
-        uint8_t *ptable = buf + SECTOR_SIZE - 2 - 64;
-        static const uint8_t _ptable_data4[] = {
-                PT_FAT16_LBA, 0, 0, 0,
-                lsb_word(1), // sector 1
-                // sector count, but we know the MS byte is zero
-                (SECTOR_COUNT - 1u) & 0xffu,
-                ((SECTOR_COUNT - 1u) >> 8u) & 0xffu,
-                ((SECTOR_COUNT - 1u) >> 16u) & 0xffu,
-        };
-        memcpy(ptable + 4, _ptable_data4, sizeof(_ptable_data4));
-
-        ptable[64] = 0x55;
-        ptable[65] = 0xaa;
-
-        memcpy(buf + MBR_OFFSET_SERIAL_NUMBER, &sn, 4);
-    } else {
-        lba--;
-        if (lba < SECTORS_PER_FAT * FAT_COUNT) {
-            // mirror
-            while (lba >= SECTORS_PER_FAT) lba -= SECTORS_PER_FAT;
-            if (!lba) {
-                memset(buf, 0x00, buf_size);
-                uint16_t *p = (uint16_t *) buf;
-                p[0] = 0xff00u | MEDIA_TYPE;
-                p[1] = 0xffff;
-                p[2] = 0xffff; // cluster2 rom.eep 
-                p[3] = 0x0004; // cluster[3..6] rom.fla
-                p[4] = 0x0005; // cluster[3..6] rom.fla
-                p[5] = 0x0006; // cluster[3..6] rom.fla
-                p[6] = 0xFFFF; // cluster[3..6] rom.fla
-                for (uint32_t x = 7; x < 0x100; x += 1) {
-                   p[x] = (uint16_t)(x + 1); //cluster[7..807] rom.n64
-                }
-            } else {
-              uint16_t *p = (uint16_t *) buf;
-              if (lba < 8) {
-                for (uint32_t x = 0; x < 0x100; x += 1) {
-                    p[x] = (uint16_t)((lba * 0x100) + x + 1); //cluster[0x7..0x807] rom.n64
-                }
-              } else if (lba == 8) {
-                for (uint32_t x = 0; x < 0x6; x += 1) {
-                    p[x] = (uint16_t)((lba * 0x100) + x + 1); //cluster[7..807] rom.n64
-                }
-                p[6] = 0xffff;
-                for (uint32_t x = 7; x < 0x100; x += 1) {
-                    p[x] = (uint16_t)((lba * 0x100) + x + 1); //cluster[808..1008] rom.z64
-                }
-              } else if (lba < 16) {
-                for (uint32_t x = 0; x < 0x100; x += 1) {
-                    p[x] = (uint16_t)((lba * 0x100) + x + 1); //cluster[808..1008] rom.z64
-                }
-              } else if (lba == 16) {
-                for (uint32_t x = 0; x < 0x06; x += 1) {
-                    p[x] = (uint16_t)((lba * 0x100) + x + 1); //cluster[808..1008] rom.z64
-                }
-                p[6] = 0xffff;
-                p[7] = (uint16_t)(0x0008 + (lba * 0x100)); // Flipped FLA.
-                p[8] = (uint16_t)(0x0009 + (lba * 0x100));
-                p[9] = (uint16_t)(0x000A + (lba * 0x100));
-                p[10] = 0xffff;              // Flipped FLA end
-                p[11] = 0xffff;              // Flipped EEPROM
-                p[12] = 0xffff;              // Cart test file.
-              } else {
-                memset(buf, 0, buf_size);
-              }
-            }
-        } else {
-            lba -= SECTORS_PER_FAT * FAT_COUNT;
-            if (lba < ROOT_DIRECTORY_SECTORS) {
-                // we don't support that many directory entries actually
-                if (!lba) {
-                    memset(buf, 0, buf_size);
-                    // root directory -- Do not use lower case letters, windows will show the file but it won't be able to "find" the data for the file.
-                    struct dir_entry *entries = (struct dir_entry *) buf;
-                    memcpy(entries[0].name, (boot_sector + BOOT_OFFSET_LABEL), 11);
-                    entries[0].attr = ATTR_VOLUME_LABEL | ATTR_ARCHIVE;
-                    uint32_t cluster_offset = 2;
-                    uint32_t size = 2 * 1024;
-                    assert(cluster_offset == (EEPROM_CLUSTER_START + 2));
-                    if (gEepromSize != 0) {
-                      init_dir_entry(++entries, "ROM     EEP", "R\0O\0M\0.\0e\0e\0p\0\0\0\0\0\0\0\0\0\0", cluster_offset, gEepromSize, 0);
-                      entries++;
-                    }
-
-                    cluster_offset += (size / CLUSTER_SIZE) + 1;
-                    assert(cluster_offset == (FLASHRAM_CLUSTER_START + 2));
-                    size = 128 * 1024;
-                    if ((gSRAMPresent != false) || (gFramPresent != false)) {
-                      init_dir_entry(++entries, "ROM     FLA", "R\0O\0M\0.\0f\0l\0a\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", cluster_offset, size, 0); // DaisyDrive64 doesn't differentiate between SRAM and FRAM for filenames.
-                      entries++;
-                    }
-
-                    cluster_offset += size / CLUSTER_SIZE;
-                    size = (64 * 1024 * 1024);
-                    assert(cluster_offset == (N64ROM_CLUSTER_START + 2));
-                    init_dir_entry(++entries, "ROM     N64", "R\0O\0M\0.\0n\0""6\0""4\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", cluster_offset, gRomSize, ATTR_READONLY);
-                    entries++;
-
-                    cluster_offset += size / CLUSTER_SIZE;
-                    size = (64 * 1024 * 1024);
-                    assert(cluster_offset == (Z64ROM_CLUSTER_START + 2));
-                    init_dir_entry(++entries, "ROMF    Z64", "R\0O\0M\0F\0.\0z\0""6\0""4\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", cluster_offset, gRomSize, ATTR_READONLY); // Same as N64 just byteflipped.
-                    entries++;
-
-                    cluster_offset += size / CLUSTER_SIZE;
-                    size = 128 * 1024;
-                    assert(cluster_offset == (FLASHRAMFLIP_CLUSTER_START + 2));
-                    if ((gSRAMPresent != false) || (gFramPresent != false)) {
-                      if (gFramPresent != false) {
-                        init_dir_entry(++entries, "ROMF    FLA", "R\0O\0M\0F\0.\0f\0l\0a\0s\0h\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0" , cluster_offset, size, 0); // Same as N64 just byteflipped, fla for Ares emulator support.
-                      } else {
-                        init_dir_entry(++entries, "ROMF    RAM", "R\0O\0M\0F\0.\0r\0a\0m\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", cluster_offset, size, 0); // Same as N64 just byteflipped, ram for Ares emulator support.
-                      }
-                      entries++;
-                    }
-
-                    cluster_offset += size / CLUSTER_SIZE;
-                    size = 2 * 1024;
-                    assert(cluster_offset == (EEPROMFLIP_CLUSTER_START + 2));
-                    if (gEepromSize != 0) {
-                      init_dir_entry(++entries, "ROMF    EEP", "R\0O\0M\0F\0.\0e\0e\0p\0r\0o\0m\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", cluster_offset, gEepromSize, 0);
-                      entries++;
-                    }
-
-                    cluster_offset += (size / CLUSTER_SIZE) + 1;
-                    size = 2 * 1024;
-                    assert(cluster_offset == (CARTTEST_CLUSTER_START + 2));
-                    init_dir_entry(++entries, "CARTTESTTXT", "C\0a\0r\0t\0T\0e\0s\0t\0.\0t\0x\0t\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", cluster_offset, size, ATTR_READONLY);
-                    entries++;
-                } else {
-                  memset(buf, 0, buf_size);
-                }
-            } else {
-                lba -= ROOT_DIRECTORY_SECTORS;
-                uint cluster = lba >> CLUSTER_SHIFT;
-                uint cluster_offset = lba - (cluster << CLUSTER_SHIFT);
-                {
-                  // Lookup cluster by entry
-                  if (cluster == CARTTEST_CLUSTER_START) {
-                    memset(buf, 0, SECTOR_SIZE);
-                      if (cluster_offset == 0) {
-                        const char* NotPresent = "Not present";
-                        const char* Failed = "Failed";
-                        const char* OK = "OK!";
-                        const char* PAL = "PAL";
-                        const char* NTSC = "NTSC";
-                        const char* EepString = Failed;
-                        const char* CICString = Failed;
-                        if (gEepromSize == 0) {
-                          EepString = NotPresent;
-                        } else if (gEepromSize == 0x200) {
-                          EepString = "4K OK!";
-                        } else if (gEepromSize == 0x800) {
-                          EepString = "16K OK!";
-                        }
-                        if (gCICType == CIC_TYPE_INVALID) {
-                          CICString = Failed;
-                        } else if (gCICType == CIC_TYPE_PAL) {
-                          CICString = PAL;
-                        } else if (gCICType == CIC_TYPE_NTSC) {
-                          CICString = NTSC;
-                        }
-
-                        sprintf(buf,
-                        "\nCart tester report:\n\n"
-                        "    EEPROM     - %s\n"
-                        "    SRAM       - %s\n"
-                        "    FlashRam   - %s (%02X)\n"
-                        "    CIC        - %s %s\n"
-                        "    Romsize    - %luMB\n"
-                        "    RomName    - %s\n"
-                        "    RomID      - %04X %c%c\n"
-                        "    CartType   - %c\n"
-                        "    RomRegion  - %c\n"
-                        "    RomVersion - %02X\n",
-                        EepString,
-                        (gSRAMPresent != 0) ? OK : NotPresent,
-                        (gFramPresent != 0) ? OK : NotPresent, gFlashType,
-                        CICString,
-                        gCICName,
-                        (gRomSize / (1024 * 1024)),
-                        (char*)gGameTitle,
-                        gGameCode[1], ((gGameCode[1] >> 8) & 0xFF), (gGameCode[1] & 0xFF),
-                        gGameCode[0] & 0xFF,
-                        ((gGameCode[2] >> 8) & 0xFF),
-                        (gGameCode[2] & 0xFF)
-                        );
-                      } else {
-                        memset(buf, 0, SECTOR_SIZE);
-                      }
-                  } else if (cluster == EEPROMFLIP_CLUSTER_START) {
-                      uint32_t address = (((uint32_t)cluster - (EEPROMFLIP_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      ReadEepromData(address / 8, buf);
-                  } else if (cluster >= FLASHRAMFLIP_CLUSTER_START) {
-                      // Read SRAM/FRAM -- check if the cart responds to Flashram info request first, if not treat as SRAM.
-                      // Also support Dezaemon's banked SRAM.
-                      uint32_t address = (((uint32_t)cluster - (FLASHRAMFLIP_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      if (gFramPresent != 0) {
-                        FlashRamRead512B(address, (uint16_t*)buf, true);
-                      } else {
-                        SRAMRead512B(address, (uint16_t*)buf, true);
-                      }
-                  } else if (cluster >= Z64ROM_CLUSTER_START) {
-                      // Read Z64 rom
-                      uint32_t address = (((uint32_t)cluster - (Z64ROM_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      address += 0x10000000;
-                      set_address(address);
-                      for (uint32_t i = 0; i < 256; i += 1) {
-                          ((uint16_t*)buf)[i] = flip16(read16());
-                      }
-                  } else if (cluster >= N64ROM_CLUSTER_START) {
-                      // Read N64 rom
-                      volatile uint32_t n64romstart = N64ROM_CLUSTER_START;
-                      n64romstart = n64romstart;
-                      uint32_t address = (((uint32_t)cluster - (N64ROM_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      address += 0x10000000;
-                      uint32_t written = 0;
-                      while (buf_size) {
-                        set_address(address);
-                        for (uint32_t i = 0; i < 256; i += 1) {
-                            ((uint16_t*)buf)[i + (((uint32_t)written)/2)] = read16();
-                        }
-                        buf_size -= 512;
-                        address += 512;
-                        written += 512;
-                      }
-                  } else if (cluster >= FLASHRAM_CLUSTER_START) {
-                      // Read SRAM/FRAM -- check if the cart responds to Flashram info request first, if not treat as SRAM.
-                      // Also support Dezaemon's banked SRAM.
-                      uint32_t address = (((uint32_t)cluster - (FLASHRAM_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      if (gFramPresent != 0) {
-                        FlashRamRead512B(address, (uint16_t*)buf, false);
-                      } else {
-                        SRAMRead512B(address, (uint16_t*)buf, true);
-                      }
-
-                  } else if (cluster == EEPROM_CLUSTER_START) {
-                      uint32_t address = (((uint32_t)cluster - (FLASHRAM_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      ReadEepromData(address / 8, buf);
-                  }
-                }
-            }
+
+    // Returning less than buf_size (or 0 for busy) makes tinyusb call again for the rest,
+    // the USB endpoint keeps transmitting the previous data while core1 fetches the next blocks.
+    uint32_t done = 0;
+    while (done < buf_size) {
+        // Even the MBR needs the probe results, the geometry follows the cart.
+        if (vd_layout_ready() == false) {
+            break;
+        }
+
+        uint32_t length = read10_run(lba, ((uint8_t*)buf) + done, buf_size - done);
+        if (length == 0) {
+            break;
         }
+
+        lba += length / SECTOR_SIZE;
+        done += length;
     }
 
-    return (int32_t)512;
+    return (int32_t)done;
 }
 
 //#define CFG_EXAMPLE_MSC_READONLY
@@ -611,80 +827,42 @@ bool tud_msc_is_writable_cb (uint8_t lun)
 #endif
 }
 
+// Write a single sector, returns the number of bytes consumed. Metadata and read only regions drop the data.
+static uint32_t write10_sector(uint32_t lba, uint8_t* buffer)
+{
+    if (lba < DATA_LBA) {
+        return SECTOR_SIZE; // Not writable.
+    }
+
+    lba -= DATA_LBA;
+    const DiskExtent *Extent = vd_find_extent(lba >> ClusterShift);
+    if ((Extent != NULL) && (Extent->Region->Write != NULL)) {
+        uint32_t Offset = (lba - (Extent->Cluster << ClusterShift)) * SECTOR_SIZE;
+        Extent->Region->Write(Extent->Region, Offset, buffer);
+    }
+
+    return SECTOR_SIZE;
+}
+
 // Callback invoked when received WRITE10 command.
 // Process data in buffer to disk's storage and return number of written bytes
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset,  uint8_t* buffer, uint32_t bufsize)
 {
   (void) lun;
+  (void) offset;
+  assert(offset == 0);
 
-  // out of ramdisk
-  if ( lba >= DISK_BLOCK_NUM ) return -1;
+  // Busy until the cart is probed.
+  if (vd_layout_ready() == false) return 0;
 
-  (void)lun;
-    (void)offset;
-    assert(offset == 0);
-    if (!lba) {
-       return 512; // Not writable.
-    }
-    lba--;
+  // out of ramdisk
+  if ( (lba + (bufsize / SECTOR_SIZE)) > SectorCount ) return -1;
 
-    if (!lba) {
-        return 512; // Not writable.
-    } else {
-        lba--;
-        if (lba < SECTORS_PER_FAT * FAT_COUNT) {
-            return 512; // Not writable.
-        } else {
-            lba -= SECTORS_PER_FAT * FAT_COUNT;
-            if (lba < ROOT_DIRECTORY_SECTORS) {
-                // we don't support that many directory entries actually
-                return 512; // Not writable.
-            } else {
-                lba -= ROOT_DIRECTORY_SECTORS;
-                uint cluster = lba >> CLUSTER_SHIFT;
-                uint cluster_offset = lba - (cluster << CLUSTER_SHIFT);
-                {
-                  // Lookup cluster by entry
-                  if (cluster == CARTTEST_CLUSTER_START) {
-                        return 512; // Not writable.
-                  } else if (cluster == EEPROMFLIP_CLUSTER_START) {
-                      uint32_t address = (((uint32_t)cluster - (EEPROMFLIP_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      WriteEepromData(address / 8, buffer);
-                  } else if ((cluster >= FLASHRAMFLIP_CLUSTER_START) && (cluster < FLASHRAMFLIP_CLUSTER_START + 4)) {
-                      // Read SRAM/FRAM -- check if the cart responds to Flashram info request first, if not treat as SRAM.
-                      // Also support Dezaemon's banked SRAM.
-                      uint32_t address = (((uint32_t)cluster - (FLASHRAMFLIP_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-
-                      if (gFramPresent != 0) {
-                        FlashRamWrite512B(address, buffer, true);
-
-                      } else {
-                        address += 0x08000000;
-                        SRAMWrite512B(address, buffer, true);
-                      }
-                  } else if (cluster >= Z64ROM_CLUSTER_START) {
-                      return 512; // Read only. 
-                  } else if (cluster >= N64ROM_CLUSTER_START) {
-                      return 512; // Read only.
-                  } else if ((cluster >= FLASHRAM_CLUSTER_START) && ((cluster < (FLASHRAM_CLUSTER_START + 4)))) {
-                      // Read SRAM/FRAM -- check if the cart responds to Flashram info request first, if not treat as SRAM.
-                      // TODO: support Dezaemon's banked SRAM.
-                      uint32_t address = (((uint32_t)cluster - (FLASHRAM_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      if (gFramPresent != 0) {
-                        FlashRamWrite512B(address, buffer, false);
-                      } else {
-                        address += 0x08000000;
-                        SRAMWrite512B(address, buffer, false);
-                      }
-
-                  } else if (cluster == EEPROM_CLUSTER_START) {
-                      uint32_t address = (((uint32_t)cluster - (FLASHRAM_CLUSTER_START)) * CLUSTER_SIZE) + (cluster_offset * SECTOR_SIZE);
-                      WriteEepromData(address / 8, buffer);
-                  }
-                }
-            }
-        }
-    }
+  uint32_t done = 0;
+  while (done < bufsize) {
+    done += write10_sector(lba, buffer + done);
+    lba += 1;
+  }
 
   return (int32_t) bufsize;
 }
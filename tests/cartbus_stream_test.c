@@ -0,0 +1,172 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * CartBus stream test
+ * Drives the latch decisions of cart_read_burst against a simulated cart that only auto-increments within the
+ * 512 byte PI page. A latch the engine skips when it shouldn't shows up as wrong data, a latch it takes when it
+ * could have skipped it shows up in the latch count.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cartbus.h"
+
+#define ROM_SIZE (64 * 1024)
+
+static int Failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf(__VA_ARGS__); printf("\n"); Failures += 1; } } while (0)
+
+// Simulated cart, the address counter wraps at the end of the page instead of moving on to the next one.
+static uint32_t CartCounter;
+static uint32_t Latches;
+static CartBusStream Stream;
+
+static uint16_t rom_halfword(uint32_t address)
+{
+    uint32_t Value = (address & (ROM_SIZE - 1)) * 2654435761u;
+    return (uint16_t)(Value >> 16);
+}
+
+static void cart_latch(uint32_t address)
+{
+    CartCounter = address;
+    Latches += 1;
+}
+
+static uint16_t cart_read(void)
+{
+    uint16_t Value = rom_halfword(CartCounter);
+    CartCounter = (CartCounter & ~(CARTBUS_PAGE_SIZE - 1)) | ((CartCounter + 2) & (CARTBUS_PAGE_SIZE - 1));
+    return Value;
+}
+
+// Any bit-banged access moves the cart address, cartbus_release drops the stream for it.
+static void cart_foreign_access(uint32_t address)
+{
+    Stream.Valid = false;
+    CartCounter = address;
+}
+
+// The chunk loop of cart_read_burst with the PIO and DMA replaced by the simulated cart.
+static void read_burst(uint32_t address, uint16_t *buffer, uint32_t length)
+{
+    while (length != 0) {
+        bool Latch;
+        uint32_t chunk = cartbus_stream_chunk(&Stream, address, length, &Latch);
+        if (Latch != false) {
+            cart_latch(address);
+        }
+
+        for (uint32_t i = 0; i < (chunk / 2); i += 1) {
+            buffer[i] = cart_read();
+        }
+
+        address += chunk;
+        buffer += chunk / 2;
+        length -= chunk;
+        cartbus_stream_advance(&Stream, address);
+    }
+}
+
+// Reads and checks the data, returns the number of latches the read took.
+static uint32_t checked_read(uint32_t address, uint32_t length)
+{
+    static uint16_t Buffer[ROM_SIZE / 2];
+    uint32_t Before = Latches;
+    read_burst(address, Buffer, length);
+    for (uint32_t i = 0; i < (length / 2); i += 1) {
+        if (Buffer[i] != rom_halfword(address + (i * 2))) {
+            CHECK(false, "read %08x+%x: wrong data at %08x", address, length, address + (i * 2));
+            break;
+        }
+    }
+
+    return Latches - Before;
+}
+
+static uint32_t pages_touched(uint32_t address, uint32_t length)
+{
+    return ((address + length - 1) / CARTBUS_PAGE_SIZE) - (address / CARTBUS_PAGE_SIZE) + 1;
+}
+
+static void test_fixed_cases(void)
+{
+    Stream.Valid = false;
+
+    // A block read latches once per page.
+    CHECK(checked_read(0x1000, 0x1000) == 8, "4KB block should latch 8 times");
+
+    // Reads continuing within a page skip the latch.
+    CHECK(checked_read(0x2000, 0x100) == 1, "first read of a page latches");
+    CHECK(checked_read(0x2100, 0x80) == 0, "contiguous read within the page should not latch");
+    CHECK(checked_read(0x2180, 0x80) == 0, "contiguous read up to the page end should not latch");
+
+    // Continuing into the next page needs the relatch.
+    CHECK(checked_read(0x2200, 0x40) == 1, "contiguous read starting a new page has to latch");
+
+    // A read across a page boundary latches at the start and again at the boundary.
+    CHECK(checked_read(0x31F0, 0x40) == 2, "unaligned read across a page boundary latches twice");
+    CHECK(checked_read(0x3230, 0x10) == 0, "read continuing after the boundary should not latch");
+
+    // Jumping elsewhere latches, even within the same page.
+    CHECK(checked_read(0x3280, 0x10) == 1, "non contiguous read has to latch");
+
+    // Someone else moved the cart address.
+    cart_foreign_access(0x8000);
+    CHECK(checked_read(0x3250, 0x10) == 1, "read after a foreign bus access has to latch");
+}
+
+// Random reads, mostly continuing the last one, with the odd foreign access. Every read has to return the right
+// data with exactly one latch per page it touches, minus one when it continues the stream mid page.
+static void test_random_reads(void)
+{
+    uint32_t Seed = 12345;
+    uint32_t Next = 0;
+    bool NextValid = false;
+    Stream.Valid = false;
+
+    for (uint32_t n = 0; n < 100000; n += 1) {
+        Seed = (Seed * 1103515245u) + 12345u;
+        uint32_t Kind = (Seed >> 16) % 8;
+        uint32_t Length = (((Seed >> 8) % 0x400) + 1) * 4;
+        uint32_t Address = (Kind < 5) ? Next : (((Seed >> 4) * 4) % ROM_SIZE);
+        if ((Address + Length) > ROM_SIZE) {
+            Address = 0;
+        }
+
+        if (Kind == 7) {
+            cart_foreign_access(Seed & 0xFFFE);
+            NextValid = false;
+        }
+
+        uint32_t Expected = pages_touched(Address, Length);
+        if ((NextValid != false) && (Address == Next) && ((Address & (CARTBUS_PAGE_SIZE - 1)) != 0)) {
+            Expected -= 1;
+        }
+
+        uint32_t Taken = checked_read(Address, Length);
+        CHECK(Taken == Expected, "read %08x+%x latched %u times, expected %u", Address, Length, Taken, Expected);
+        Next = Address + Length;
+        NextValid = true;
+        if (Failures > 10) {
+            return;
+        }
+    }
+}
+
+int main(void)
+{
+    test_fixed_cases();
+    test_random_reads();
+    if (Failures != 0) {
+        printf("cartbus_stream_test: %d failures\n", Failures);
+        return 1;
+    }
+
+    printf("cartbus_stream_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Crc32 test
+ * Checks the slicing-by-8 si_crc32 against the published check values and against the bitwise definition for every
+ * length up to a few steps of 8 bytes at every alignment, plus a full ROM cache block.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "crc32.h"
+
+#define CRC32_BLOCK_SIZE (4096)
+
+static int Failures = 0;
+
+static uint32_t crc32_bitwise(const uint8_t *data, size_t size)
+{
+    uint32_t c = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i += 1) {
+        c ^= data[i];
+        for (uint32_t k = 0; k < 8; k += 1) {
+            c = ((c & 1) != 0) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+    }
+
+    return c ^ 0xFFFFFFFF;
+}
+
+static void check_crc(const char *name, const uint8_t *data, size_t size, uint32_t expected)
+{
+    uint32_t Crc = si_crc32(data, size);
+    if (Crc != expected) {
+        printf("%s (%zu bytes at +%u): %08x, expected %08x\n", name, size, (uint32_t)(((uintptr_t)data) & 7), Crc,
+               expected);
+        Failures += 1;
+    }
+}
+
+int main(void)
+{
+    // Word aligned like the cart buffers, the offsets below make the unaligned cases.
+    static uint32_t Buffer[(CRC32_BLOCK_SIZE / 4) + 2];
+    uint8_t *Bytes = (uint8_t*)Buffer;
+    uint32_t Seed = 0x12345678;
+    for (uint32_t i = 0; i < sizeof(Buffer); i += 1) {
+        Seed = (Seed * 1103515245u) + 12345u;
+        Bytes[i] = (uint8_t)(Seed >> 16);
+    }
+
+    static const char Check[] = "123456789";
+    check_crc("empty", (const uint8_t*)Check, 0, 0x00000000);
+    check_crc("check", (const uint8_t*)Check, 9, 0xCBF43926);
+
+    static const uint8_t Zeros[32] = { 0 };
+    check_crc("zeros", Zeros, sizeof(Zeros), 0x190A55AD);
+
+    // Head bytes up to alignment, the 8 byte steps and the tail all get exercised.
+    for (uint32_t Offset = 0; Offset < 8; Offset += 1) {
+        for (uint32_t Length = 0; Length <= 64; Length += 1) {
+            check_crc("random", Bytes + Offset, Length, crc32_bitwise(Bytes + Offset, Length));
+        }
+    }
+
+    check_crc("block", Bytes, CRC32_BLOCK_SIZE, crc32_bitwise(Bytes, CRC32_BLOCK_SIZE));
+    check_crc("block", Bytes + 3, CRC32_BLOCK_SIZE, crc32_bitwise(Bytes + 3, CRC32_BLOCK_SIZE));
+
+    if (Failures != 0) {
+        printf("crc32_test: %d failures\n", Failures);
+        return 1;
+    }
+
+    printf("crc32_test: ok\n");
+    return 0;
+}
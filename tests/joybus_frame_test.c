@@ -0,0 +1,150 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * JoybusFrame test
+ * Checks the table encoder and the prebuilt frames against convertToPio, the bit loop they replaced, for every
+ * block number and a spread of payloads. Then times both on the host, the new side including the template copy and
+ * the copy into the TX buffer that JoybusRun does. The numbers are printed but not checked.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "joybusframe.h"
+
+#define BENCH_FRAMES (2000000)
+
+static int Failures = 0;
+static volatile uint32_t Sink;
+
+// Stands in for the engine's TX buffer, JoybusRun copies every frame into it.
+static uint32_t TxFrame[8];
+
+// The encoder joybus.c used before the byte table, kept verbatim as the reference.
+static void convertToPio(const uint8_t* command, const int len, uint32_t* result, int* resultLen)
+{
+    if (len == 0) {
+        *resultLen = 0;
+        return;
+    }
+
+    *resultLen = len / 2 + 1;
+    int i;
+    for (i = 0; i < *resultLen; i++) {
+        result[i] = 0;
+    }
+
+    for (i = 0; i < len; i++) {
+        for (int j = 0; j < 8; j++) {
+            result[i / 2] += (uint32_t)(1 << (2 * (8 * (i % 2) + j) + 1));
+            result[i / 2] += (uint32_t)((!!(command[i] & (0x80u >> j))) << (2 * (8 * (i % 2) + j)));
+        }
+    }
+
+    result[len / 2] += 3 << (2 * (8 * (len % 2)));
+}
+
+static void check_frame(const char *name, uint32_t block, const uint8_t *command, int length,
+                        const uint32_t *frame, int words)
+{
+    uint32_t Reference[8];
+    int ReferenceWords;
+    convertToPio(command, length, Reference, &ReferenceWords);
+    if ((ReferenceWords != words) || (memcmp(Reference, frame, words * 4) != 0)) {
+        printf("%s frame of block %u differs from convertToPio\n", name, block);
+        Failures += 1;
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return ((double)Time.tv_sec * 1e9) + (double)Time.tv_nsec;
+}
+
+static void benchmark(void)
+{
+    uint32_t Frame[8];
+    int Words;
+    uint8_t Command[10] = { 0x05, 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+
+    double Start = now_ns();
+    for (uint32_t k = 0; k < BENCH_FRAMES; k += 1) {
+        Command[1] = (uint8_t)k;
+        Command[9] = (uint8_t)(k >> 8);
+        convertToPio(Command, 10, Frame, &Words);
+        Sink = Frame[0] ^ Frame[4];
+    }
+
+    double OldWrite = now_ns() - Start;
+    Start = now_ns();
+    for (uint32_t k = 0; k < BENCH_FRAMES; k += 1) {
+        Command[1] = (uint8_t)k;
+        Command[9] = (uint8_t)(k >> 8);
+        JoybusBuildWrite(Command[1], &Command[2], Frame);
+        memcpy(TxFrame, Frame, 6 * 4);
+        Sink = TxFrame[0] ^ TxFrame[4];
+    }
+
+    double NewWrite = now_ns() - Start;
+    Start = now_ns();
+    for (uint32_t k = 0; k < BENCH_FRAMES; k += 1) {
+        Command[0] = 0x04;
+        Command[1] = (uint8_t)k;
+        convertToPio(Command, 2, Frame, &Words);
+        Sink = Frame[0];
+    }
+
+    double OldRead = now_ns() - Start;
+    Start = now_ns();
+    for (uint32_t k = 0; k < BENCH_FRAMES; k += 1) {
+        uint32_t Read[2] = { JoybusPatchBlock(ReadTemplate[0], k), ReadTemplate[1] };
+        memcpy(TxFrame, Read, sizeof(Read));
+        Sink = TxFrame[0] ^ TxFrame[1];
+    }
+
+    double NewRead = now_ns() - Start;
+    printf("write frame: convertToPio %.1fns, table %.1fns\n", OldWrite / BENCH_FRAMES, NewWrite / BENCH_FRAMES);
+    printf("read frame:  convertToPio %.1fns, table %.1fns\n", OldRead / BENCH_FRAMES, NewRead / BENCH_FRAMES);
+}
+
+int main(void)
+{
+    for (uint32_t Byte = 0; Byte < 256; Byte += 1) {
+        uint8_t Data[2] = { (uint8_t)Byte, (uint8_t)(255 - Byte) };
+        uint32_t Word = JoybusEncodePair(Data[0], Data[1]);
+        check_frame("pair", Byte, Data, 2, (uint32_t[]){ Word, JOYBUS_STOP }, 2);
+    }
+
+    uint8_t Info[1] = { 0x00 };
+    check_frame("info", 0, Info, 1, InfoTemplate, 1);
+
+    for (uint32_t Block = 0; Block < 256; Block += 1) {
+        uint8_t Read[2] = { 0x04, (uint8_t)Block };
+        uint32_t ReadFrame[2] = { JoybusPatchBlock(ReadTemplate[0], Block), ReadTemplate[1] };
+        check_frame("read", Block, Read, 2, ReadFrame, 2);
+
+        for (uint32_t Seed = 0; Seed < 16; Seed += 1) {
+            uint8_t Write[10] = { 0x05, (uint8_t)Block };
+            for (uint32_t i = 0; i < 8; i += 1) {
+                Write[i + 2] = (uint8_t)((Block * 7) + (Seed * 131) + (i * 31));
+            }
+
+            uint32_t WriteFrame[6];
+            JoybusBuildWrite(Block, &Write[2], WriteFrame);
+            check_frame("write", Block, Write, 10, WriteFrame, 6);
+        }
+    }
+
+    if (Failures != 0) {
+        printf("joybus_frame_test: %d failures\n", Failures);
+        return 1;
+    }
+
+    benchmark();
+    printf("joybus_frame_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,122 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * RomSize test
+ * Runs romsize_probe against simulated carts of every candidate size, one that mirrors past its end and one
+ * that leaves the bus open, plus ROMs padded with zeros or 0xFF that must not end early.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "n64cartinterface.h"
+#include "romsize.h"
+
+#define MB (1024 * 1024)
+
+typedef enum _SimBeyondEnd
+{
+    SIM_MIRROR,
+    SIM_OPEN_BUS,
+} SimBeyondEnd;
+
+// The simulated cart. Data is a hash of the offset up to DataSize, Padding from there up to Size.
+static uint32_t SimSize;
+static uint32_t SimDataSize;
+static uint16_t SimPadding;
+static SimBeyondEnd SimBeyond;
+static uint32_t Reads;
+
+static int Failures = 0;
+
+// Bitwise reference CRC, the firmware's table driven one lives with the cart interface.
+uint32_t si_crc32(const uint8_t *data, size_t size)
+{
+    uint32_t c = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i += 1) {
+        c ^= data[i];
+        for (uint32_t k = 0; k < 8; k += 1) {
+            c = ((c & 1) != 0) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+    }
+
+    return c ^ 0xFFFFFFFF;
+}
+
+static uint16_t sim_rom_halfword(uint32_t offset)
+{
+    if (offset >= SimDataSize) {
+        return SimPadding;
+    }
+
+    uint32_t Value = (offset + 0x9E37) * 2654435761u;
+    return (uint16_t)((Value >> 16) ^ Value);
+}
+
+// Same contract as cart_read_burst. The cart only auto-increments within a 512 byte page, an open bus returns the
+// low halfword of whatever address was latched last.
+static void sim_read(uint32_t address, uint16_t *buffer, uint32_t length)
+{
+    uint32_t Latched = address;
+    Reads += 1;
+    for (uint32_t i = 0; i < (length / 2); i += 1) {
+        uint32_t Address = address + (i * 2);
+        if ((Address & 0x1FF) == 0) {
+            Latched = Address;
+        }
+
+        uint32_t Offset = Address - CART_ADDRESS_START;
+        if (Offset < SimSize) {
+            buffer[i] = sim_rom_halfword(Offset);
+        } else if (SimBeyond == SIM_MIRROR) {
+            buffer[i] = sim_rom_halfword(Offset % SimSize);
+        } else {
+            buffer[i] = (uint16_t)Latched;
+        }
+    }
+}
+
+static void check_probe(const char *name, uint32_t size, uint32_t data_size, uint16_t padding, SimBeyondEnd beyond,
+                        uint32_t expected)
+{
+    SimSize = size;
+    SimDataSize = data_size;
+    SimPadding = padding;
+    SimBeyond = beyond;
+    Reads = 0;
+
+    uint32_t Probed = romsize_probe(sim_read);
+    if (Probed != expected) {
+        printf("%s %uMB: probed %uMB, expected %uMB\n", name, size / MB, Probed / MB, expected / MB);
+        Failures += 1;
+    }
+}
+
+int main(void)
+{
+    static const uint32_t Sizes[] = { 4, 8, 12, 16, 20, 24, 32, 40, 48, 64 };
+    for (uint32_t i = 0; i < (sizeof(Sizes) / sizeof(Sizes[0])); i += 1) {
+        uint32_t Size = Sizes[i] * MB;
+        check_probe("mirrored", Size, Size, 0, SIM_MIRROR, Size);
+        check_probe("open bus", Size, Size, 0, SIM_OPEN_BUS, Size);
+
+        // Padding reads back like an open bus at a boundary latching a low halfword of 0, the probe has to look
+        // past it. Only the first 2MB carry data.
+        check_probe("zero padded", Size, 2 * MB, 0x0000, SIM_OPEN_BUS, Size);
+        check_probe("zero padded mirrored", Size, 2 * MB, 0x0000, SIM_MIRROR, Size);
+        check_probe("0xFF padded", Size, 2 * MB, 0xFFFF, SIM_OPEN_BUS, Size);
+    }
+
+    // Open bus past the end of a ROM that is not one of the candidate sizes rounds up to the next candidate.
+    check_probe("odd size", 10 * MB, 10 * MB, 0, SIM_OPEN_BUS, 12 * MB);
+
+    if (Failures != 0) {
+        printf("romsize_test: %d failures\n", Failures);
+        return 1;
+    }
+
+    printf("romsize_test: ok\n");
+    return 0;
+}
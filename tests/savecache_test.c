@@ -0,0 +1,875 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * SaveCache test
+ * Runs the save write-back against a simulated FlashRAM. The chip erases and programs like the real one: an erase
+ * sets a 16KB sector or the whole chip to ones, a program can only clear bits, and both keep the chip busy for a
+ * while on a simulated clock. Every erase and program is logged and has to match the minimum sequence for the pages
+ * the host changed, the chip has to end up holding what the host wrote. Every status poll is logged as well and has
+ * to follow the schedule: the first one after 3/4 of the last measured duration of the same operation, then backing
+ * off from 20us to 2ms.
+ * The SRAM write-back runs against a simulated bus holding the banks SRAM_BANK_STRIDE apart. It has to write only
+ * the changed halfword runs, rewrite the ones a flaky bus lost, give up on a page after four passes, keep every
+ * access inside one bank and serve both files byte flipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "n64cartinterface.h"
+#include "cartbus.h"
+#include "savecache.h"
+
+#define SIM_PAGES         (SAVECACHE_SIZE / FLASHRAM_PAGE_SIZE)
+#define SIM_SECTORS       (SAVECACHE_SIZE / FLASHRAM_SECTOR_SIZE)
+#define SIM_SECTOR_PAGES  (FLASHRAM_SECTOR_SIZE / FLASHRAM_PAGE_SIZE)
+#define SIM_LOG_SIZE      (4096)
+#define SIM_POLL_LOG_SIZE (65536)
+#define SIM_RUN_LOG_SIZE  (256)
+
+#define SIM_SRAM_NOT_STUCK (0xFFFFFFFF)
+
+// Busy times of the simulated chip.
+#define SIM_ERASE_CHIP_US   (60000)
+#define SIM_ERASE_SECTOR_US (15000)
+#define SIM_PROGRAM_US      (200)
+
+// The poll schedule the write-back has to follow.
+#define POLL_MIN_US (20)
+#define POLL_MAX_US (2000)
+
+enum SIM_OP {
+    SIM_ERASE_CHIP,
+    SIM_ERASE_SECTOR,
+    SIM_PROGRAM,
+    SIM_OP_COUNT,
+};
+
+static const uint32_t SimBusyUs[SIM_OP_COUNT] = { SIM_ERASE_CHIP_US, SIM_ERASE_SECTOR_US, SIM_PROGRAM_US };
+
+typedef struct _SimOp
+{
+    uint32_t Op;
+    uint32_t Offset;
+    uint32_t StartUs;
+} SimOp;
+
+typedef struct _SimRun
+{
+    uint32_t Offset;
+    uint32_t Count;
+} SimRun;
+
+uint32_t gFramPresent = 0;
+uint32_t gSRAMPresent = 0;
+uint32_t gSRAMSize = SRAM_SIZE;
+bool gSRAMBanked = false;
+
+static uint32_t SimNowUs = 0;
+static uint8_t SimChip[SAVECACHE_SIZE];
+static uint32_t SimBusyUntilUs = 0;
+static SimOp SimLog[SIM_LOG_SIZE];
+static uint32_t SimLogCount = 0;
+static uint32_t SimPolls[SIM_POLL_LOG_SIZE];
+static uint32_t SimPollCount = 0;
+
+// Last duration of each operation as the write-back measures it, its polls only see the chip at poll times.
+static uint32_t ModelMeasuredUs[SIM_OP_COUNT];
+
+// SRAM as it sits on the bus, a banked SRAM has its banks SRAM_BANK_STRIDE apart.
+static uint8_t SimSram[SRAM_BANKS * SRAM_BANK_STRIDE];
+static uint8_t SimSramBefore[SRAM_BANKS * SRAM_BANK_STRIDE];
+static SimRun SimRuns[SIM_RUN_LOG_SIZE];
+static uint32_t SimRunCount = 0;
+static uint32_t SimSramReads = 0;
+static uint32_t SimSramLatches = 0;
+static bool SimSramFlaky = false;
+static uint32_t SimSramStuck = SIM_SRAM_NOT_STUCK;
+static SimRun ExpectedRuns[SIM_RUN_LOG_SIZE];
+static uint32_t ExpectedRunCount = 0;
+
+// What the host wrote last, the chip has to match it once the write-back is done.
+static uint8_t HostImage[SAVECACHE_SIZE];
+static SimOp Expected[SIM_LOG_SIZE];
+static uint32_t ExpectedCount = 0;
+
+static int Failures = 0;
+
+uint32_t time_us_32(void)
+{
+    return SimNowUs;
+}
+
+absolute_time_t get_absolute_time(void)
+{
+    return SimNowUs;
+}
+
+uint32_t to_ms_since_boot(absolute_time_t t)
+{
+    return (uint32_t)(t / 1000);
+}
+
+void cartbus_lock(void)
+{
+}
+
+void cartbus_unlock(void)
+{
+}
+
+void flip16_buffer(uint16_t *buffer, uint32_t length)
+{
+    for (uint32_t i = 0; i < (length / 2); i += 1) {
+        buffer[i] = (uint16_t)((buffer[i] << 8) | (buffer[i] >> 8));
+    }
+}
+
+static bool sim_busy(void)
+{
+    return (int32_t)(SimNowUs - SimBusyUntilUs) < 0;
+}
+
+static void sim_start(uint32_t op, uint32_t offset)
+{
+    if (sim_busy() != false) {
+        printf("operation %u at %05x started while the chip is busy\n", op, offset);
+        Failures += 1;
+    }
+
+    if (SimLogCount < SIM_LOG_SIZE) {
+        SimLog[SimLogCount].Op = op;
+        SimLog[SimLogCount].Offset = offset;
+        SimLog[SimLogCount].StartUs = SimNowUs;
+        SimLogCount += 1;
+    }
+
+    SimBusyUntilUs = SimNowUs + SimBusyUs[op];
+}
+
+static void sim_read(uint32_t offset, uint16_t *buffer, uint32_t length)
+{
+    if (sim_busy() != false) {
+        printf("read at %05x while the chip is busy\n", offset);
+        Failures += 1;
+    }
+
+    memcpy(buffer, &SimChip[offset], length);
+}
+
+void FlashRamRead512B(uint32_t address, uint16_t *buffer, bool flip)
+{
+    sim_read(address, buffer, SAVECACHE_SECTOR_SIZE);
+    if (flip != false) {
+        flip16_buffer(buffer, SAVECACHE_SECTOR_SIZE);
+    }
+}
+
+void FlashRamReadPage128B(uint32_t offset, uint16_t *page)
+{
+    sim_read(offset, page, FLASHRAM_PAGE_SIZE);
+}
+
+bool FlashRamBusy(void)
+{
+    if (SimPollCount < SIM_POLL_LOG_SIZE) {
+        SimPolls[SimPollCount] = SimNowUs;
+        SimPollCount += 1;
+    }
+
+    return sim_busy();
+}
+
+void FlashRamStartEraseChip(void)
+{
+    sim_start(SIM_ERASE_CHIP, 0);
+    memset(SimChip, 0xFF, sizeof(SimChip));
+}
+
+void FlashRamStartEraseSector(uint32_t offset)
+{
+    if ((offset % FLASHRAM_SECTOR_SIZE) != 0) {
+        printf("sector erase at unaligned %05x\n", offset);
+        Failures += 1;
+    }
+
+    sim_start(SIM_ERASE_SECTOR, offset);
+    memset(&SimChip[offset], 0xFF, FLASHRAM_SECTOR_SIZE);
+}
+
+void FlashRamStartProgramPage128B(uint32_t offset, const uint16_t *page)
+{
+    sim_start(SIM_PROGRAM, offset);
+    for (uint32_t i = 0; i < FLASHRAM_PAGE_SIZE; i += 1) {
+        SimChip[offset + i] &= ((const uint8_t*)page)[i];
+    }
+}
+
+// The SRAM side of the bus, the fakes map save offsets through sram_bus_address like the real accessors do.
+static uint8_t *sim_sram(uint32_t offset, uint32_t length)
+{
+    uint32_t Bus = sram_bus_address(offset) - SRAM_ADDRESS_START;
+    uint32_t Last = sram_bus_address(offset + length - 1) - SRAM_ADDRESS_START;
+    if ((length == 0) || ((offset + length) > gSRAMSize) || (Last != (Bus + length - 1))) {
+        printf("SRAM access at %05x, %u bytes, leaves the save or crosses a bank\n", offset, length);
+        Failures += 1;
+    }
+
+    return &SimSram[Bus];
+}
+
+void SRAMRead(uint32_t offset, uint16_t *buffer, uint32_t length)
+{
+    SimSramReads += 1;
+    memcpy(buffer, sim_sram(offset, length), length);
+}
+
+// Every call is one address latch. A flaky bus loses the first halfword after every other latch, a stuck
+// halfword never takes a write.
+void SRAMWriteRun(uint32_t offset, const uint16_t *data, uint32_t count)
+{
+    uint8_t *Bus = sim_sram(offset, count * 2);
+    if (SimRunCount < SIM_RUN_LOG_SIZE) {
+        SimRuns[SimRunCount].Offset = offset;
+        SimRuns[SimRunCount].Count = count;
+    }
+
+    SimRunCount += 1;
+    SimSramLatches += 1;
+    for (uint32_t i = 0; i < count; i += 1) {
+        if ((SimSramFlaky != false) && ((SimSramLatches % 2) == 1) && (i == 0)) {
+            continue;
+        }
+
+        if ((offset + (i * 2)) == SimSramStuck) {
+            continue;
+        }
+
+        memcpy(&Bus[i * 2], &data[i], 2);
+    }
+}
+
+static uint32_t sim_random(void)
+{
+    static uint32_t Seed = 0x2545F491;
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+static void fill_random(uint8_t *data, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i += 1) {
+        data[i] = (uint8_t)sim_random();
+    }
+}
+
+static bool page_blank(const uint8_t *data)
+{
+    for (uint32_t i = 0; i < FLASHRAM_PAGE_SIZE; i += 1) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A save with data in the first pages and in every seventh page after them, everything else erased.
+static void cart_insert(void)
+{
+    memset(SimChip, 0xFF, sizeof(SimChip));
+    for (uint32_t Page = 0; Page < SIM_PAGES; Page += 1) {
+        if ((Page < 10) || ((Page % 7) == 0)) {
+            fill_random(&SimChip[Page * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+        }
+    }
+
+    memcpy(HostImage, SimChip, sizeof(HostImage));
+    SimLogCount = 0;
+    SimPollCount = 0;
+    ExpectedCount = 0;
+    gFramPresent = 1;
+    gSRAMPresent = 0;
+    savecache_init();
+}
+
+// Host writes go through savecache_write in 512 byte disk sectors, like the READ10/WRITE10 path.
+static void host_write(uint32_t offset, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i += SAVECACHE_SECTOR_SIZE) {
+        savecache_write(offset + i, &HostImage[offset + i], false);
+    }
+}
+
+// Core1 loop: step while there is work, sleep until the next status poll is due. The clock jumps ahead to it.
+// Stops early once the chip was handed the given number of operations, so the host can write in the middle.
+static void run_write_back_until(uint32_t operations)
+{
+    savecache_flush();
+    for (uint32_t Steps = 0; Steps < 100000; Steps += 1) {
+        if (SimLogCount >= operations) {
+            return;
+        }
+
+        if (savecache_step() != false) {
+            continue;
+        }
+
+        uint32_t PollUs = savecache_poll_us();
+        if (PollUs == SAVECACHE_NO_POLL) {
+            return;
+        }
+
+        SimNowUs += (PollUs != 0) ? PollUs : 1;
+    }
+
+    printf("write-back did not finish\n");
+    Failures += 1;
+}
+
+static void run_write_back(void)
+{
+    run_write_back_until(SIM_LOG_SIZE);
+}
+
+// Walk the operations in order and check their polls against the schedule, the measured durations carry over from
+// one write-back to the next.
+static void check_polls(const char *name)
+{
+    uint32_t Poll = 0;
+    for (uint32_t i = 0; i < SimLogCount; i += 1) {
+        uint32_t Op = SimLog[i].Op;
+        uint32_t Start = SimLog[i].StartUs;
+        uint32_t Expected = Start + ((ModelMeasuredUs[Op] * 3) / 4);
+        uint32_t Interval = POLL_MIN_US;
+        while (true) {
+            if ((Poll >= SimPollCount) || (SimPolls[Poll] != Expected)) {
+                printf("%s: operation %u polled at +%u, expected +%u\n", name, i,
+                       (Poll < SimPollCount) ? (SimPolls[Poll] - Start) : 0, Expected - Start);
+                Failures += 1;
+                return;
+            }
+
+            Poll += 1;
+            if ((Expected - Start) >= SimBusyUs[Op]) {
+                ModelMeasuredUs[Op] = Expected - Start;
+                break;
+            }
+
+            Expected += Interval;
+            Interval = MIN(Interval * 2, POLL_MAX_US);
+        }
+    }
+
+    if (Poll != SimPollCount) {
+        printf("%s: %u polls, expected %u\n", name, SimPollCount, Poll);
+        Failures += 1;
+    }
+}
+
+static void expect(uint32_t op, uint32_t offset)
+{
+    Expected[ExpectedCount].Op = op;
+    Expected[ExpectedCount].Offset = offset;
+    ExpectedCount += 1;
+}
+
+// Every page of the sector that holds data, after an erase all of them have to be programmed again.
+static void expect_sector_programs(uint32_t sector)
+{
+    for (uint32_t i = 0; i < SIM_SECTOR_PAGES; i += 1) {
+        uint32_t Page = (sector * SIM_SECTOR_PAGES) + i;
+        if (page_blank(&HostImage[Page * FLASHRAM_PAGE_SIZE]) == false) {
+            expect(SIM_PROGRAM, Page * FLASHRAM_PAGE_SIZE);
+        }
+    }
+}
+
+static void check_write_back(const char *name)
+{
+    run_write_back();
+    if (memcmp(SimChip, HostImage, sizeof(SimChip)) != 0) {
+        printf("%s: the chip does not hold the host data\n", name);
+        Failures += 1;
+    }
+
+    uint32_t Count = (SimLogCount < ExpectedCount) ? SimLogCount : ExpectedCount;
+    for (uint32_t i = 0; i < Count; i += 1) {
+        if ((SimLog[i].Op != Expected[i].Op) || (SimLog[i].Offset != Expected[i].Offset)) {
+            printf("%s: operation %u is %u at %05x, expected %u at %05x\n", name, i, SimLog[i].Op, SimLog[i].Offset,
+                   Expected[i].Op, Expected[i].Offset);
+            Failures += 1;
+            break;
+        }
+    }
+
+    if (SimLogCount != ExpectedCount) {
+        printf("%s: %u operations, expected %u\n", name, SimLogCount, ExpectedCount);
+        Failures += 1;
+    }
+
+    check_polls(name);
+    if (savecache_poll_us() != SAVECACHE_NO_POLL) {
+        printf("%s: a poll is still scheduled after the write-back\n", name);
+        Failures += 1;
+    }
+}
+
+// Dirty pages that only clear bits are programmed in place, nothing is erased.
+static void test_clear_bits(void)
+{
+    cart_insert();
+    for (uint32_t i = 0; i < FLASHRAM_PAGE_SIZE; i += 1) {
+        HostImage[(5 * FLASHRAM_PAGE_SIZE) + i] &= 0x5A;
+    }
+
+    host_write(4 * FLASHRAM_PAGE_SIZE, SAVECACHE_SECTOR_SIZE);
+    expect(SIM_PROGRAM, 5 * FLASHRAM_PAGE_SIZE);
+    check_write_back("clear bits");
+    if ((gSaveErases != 0) || (gSavePrograms != 1)) {
+        printf("clear bits: %u erases and %u programs counted\n", gSaveErases, gSavePrograms);
+        Failures += 1;
+    }
+}
+
+// One page setting a bit takes its sector through a single erase, every page of the sector holding data is programmed
+// again, a page the host erased is not.
+static void test_partial(void)
+{
+    cart_insert();
+    fill_random(&HostImage[2 * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    memset(&HostImage[9 * FLASHRAM_PAGE_SIZE], 0xFF, FLASHRAM_PAGE_SIZE);
+    host_write(0, 3 * SAVECACHE_SECTOR_SIZE);
+    expect(SIM_ERASE_SECTOR, 0);
+    expect_sector_programs(0);
+    check_write_back("partial");
+}
+
+// Sectors are written back in order, each erased at most once. Data going to an erased page and a sector that only
+// clears bits need no erase.
+static void test_sectors(void)
+{
+    cart_insert();
+    uint32_t SetPage = (1 * SIM_SECTOR_PAGES) + 5;
+    uint32_t BlankPage = (2 * SIM_SECTOR_PAGES) + 1;
+    uint32_t ClearPage = (3 * SIM_SECTOR_PAGES) + 5;
+    fill_random(&HostImage[SetPage * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    fill_random(&HostImage[(SetPage + 42) * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    fill_random(&HostImage[BlankPage * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    memset(&HostImage[ClearPage * FLASHRAM_PAGE_SIZE], 0x00, FLASHRAM_PAGE_SIZE);
+    host_write(0, SAVECACHE_SIZE);
+    expect(SIM_ERASE_SECTOR, 1 * FLASHRAM_SECTOR_SIZE);
+    expect_sector_programs(1);
+    expect(SIM_PROGRAM, BlankPage * FLASHRAM_PAGE_SIZE);
+    expect(SIM_PROGRAM, ClearPage * FLASHRAM_PAGE_SIZE);
+    check_write_back("sectors");
+}
+
+// The host rewrote the whole file and every sector changed, one chip erase replaces the sector erases.
+static void test_whole_file(void)
+{
+    cart_insert();
+    fill_random(HostImage, sizeof(HostImage));
+    for (uint32_t Page = 0; Page < SIM_PAGES; Page += 11) {
+        memset(&HostImage[Page * FLASHRAM_PAGE_SIZE], 0xFF, FLASHRAM_PAGE_SIZE);
+    }
+
+    host_write(0, SAVECACHE_SIZE);
+    expect(SIM_ERASE_CHIP, 0);
+    for (uint32_t Sector = 0; Sector < SIM_SECTORS; Sector += 1) {
+        expect_sector_programs(Sector);
+    }
+
+    check_write_back("whole file");
+    if (gSaveChipErased == false) {
+        printf("whole file: chip erase not reported\n");
+        Failures += 1;
+    }
+}
+
+// A whole file rewrite that leaves one sector as it was erases the changed sectors one by one.
+static void test_whole_file_unchanged_sector(void)
+{
+    cart_insert();
+    fill_random(HostImage, sizeof(HostImage));
+    memcpy(&HostImage[5 * FLASHRAM_SECTOR_SIZE], &SimChip[5 * FLASHRAM_SECTOR_SIZE], FLASHRAM_SECTOR_SIZE);
+    host_write(0, SAVECACHE_SIZE);
+    for (uint32_t Sector = 0; Sector < SIM_SECTORS; Sector += 1) {
+        if (Sector != 5) {
+            expect(SIM_ERASE_SECTOR, Sector * FLASHRAM_SECTOR_SIZE);
+            expect_sector_programs(Sector);
+        }
+    }
+
+    check_write_back("whole file, one sector unchanged");
+    if (gSaveChipErased != false) {
+        printf("whole file, one sector unchanged: chip erase reported\n");
+        Failures += 1;
+    }
+}
+
+// Polls of the first sector erase ever, the last one is where the write-back measures its duration.
+static const uint32_t FirstErasePolls[] = { 0, 20, 60, 140, 300, 620, 1260, 2540, 4540, 6540, 8540, 10540, 12540,
+                                            14540, 16540 };
+
+// The next sector erase is first polled at 3/4 of that, the back-off starts over.
+static const uint32_t SecondErasePolls[] = { 12405, 12425, 12465, 12545, 12705, 13025, 13665, 14945, 16945 };
+
+static void check_erase_polls(const char *name, const uint32_t *expected, uint32_t count)
+{
+    uint32_t Start = SimLog[0].StartUs;
+    for (uint32_t i = 0; i < count; i += 1) {
+        if ((i >= SimPollCount) || ((SimPolls[i] - Start) != expected[i])) {
+            printf("%s: poll %u of the erase at +%u, expected +%u\n", name, i,
+                   (i < SimPollCount) ? (SimPolls[i] - Start) : 0, expected[i]);
+            Failures += 1;
+            return;
+        }
+    }
+
+    if (savecache_erase_us() != expected[count - 1]) {
+        printf("%s: measured erase %uus, expected %uus\n", name, savecache_erase_us(), expected[count - 1]);
+        Failures += 1;
+    }
+}
+
+// Runs first, before anything was measured, to pin the schedule to absolute numbers.
+static void test_poll_schedule(void)
+{
+    cart_insert();
+    fill_random(&HostImage[2 * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    host_write(0, SAVECACHE_SECTOR_SIZE);
+    expect(SIM_ERASE_SECTOR, 0);
+    expect_sector_programs(0);
+    check_write_back("poll schedule");
+    check_erase_polls("poll schedule", FirstErasePolls, sizeof(FirstErasePolls) / sizeof(FirstErasePolls[0]));
+
+    cart_insert();
+    fill_random(&HostImage[3 * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    host_write(0, SAVECACHE_SECTOR_SIZE);
+    expect(SIM_ERASE_SECTOR, 0);
+    expect_sector_programs(0);
+    check_write_back("poll schedule, measured");
+    check_erase_polls("poll schedule, measured", SecondErasePolls,
+                      sizeof(SecondErasePolls) / sizeof(SecondErasePolls[0]));
+}
+
+// The host writes a page of the sector while it is being erased. The page is dirty again and the erase has to leave
+// it to the programs that follow, with the new data.
+static void test_write_during_erase(void)
+{
+    cart_insert();
+    fill_random(&HostImage[2 * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    host_write(0, SAVECACHE_SECTOR_SIZE);
+    run_write_back_until(1);
+    fill_random(&HostImage[3 * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    fill_random(&HostImage[20 * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    host_write(0, 6 * SAVECACHE_SECTOR_SIZE);
+    expect(SIM_ERASE_SECTOR, 0);
+    expect_sector_programs(0);
+    check_write_back("write during erase");
+}
+
+// The host rewrites a page that was already programmed after the erase. It is dirty again and needs a bit set, the
+// sector goes through a second erase once the current one is done.
+static void test_write_after_program(void)
+{
+    cart_insert();
+    fill_random(&HostImage[2 * FLASHRAM_PAGE_SIZE], FLASHRAM_PAGE_SIZE);
+    host_write(0, SAVECACHE_SECTOR_SIZE);
+    expect(SIM_ERASE_SECTOR, 0);
+    expect_sector_programs(0);
+    run_write_back_until(4);
+    fill_random(&HostImage[0], FLASHRAM_PAGE_SIZE);
+    host_write(0, SAVECACHE_SECTOR_SIZE);
+    expect(SIM_ERASE_SECTOR, 0);
+    expect_sector_programs(0);
+    check_write_back("write after program");
+}
+
+// Writing back what the chip already holds does not touch it.
+static void test_unchanged(void)
+{
+    cart_insert();
+    host_write(0, 4 * SAVECACHE_SECTOR_SIZE);
+    check_write_back("unchanged");
+}
+
+// Save offset a bus byte belongs to, worked out from the cart layout rather than with sram_bus_address.
+static bool sram_save_offset(uint32_t bus, uint32_t *offset)
+{
+    uint32_t Bank = bus / SRAM_BANK_STRIDE;
+    uint32_t Banks = (gSRAMBanked != false) ? SRAM_BANKS : 1;
+    if ((Bank >= Banks) || ((bus % SRAM_BANK_STRIDE) >= SRAM_BANK_SIZE)) {
+        return false;
+    }
+
+    *offset = (Bank * SRAM_BANK_SIZE) + (bus % SRAM_BANK_STRIDE);
+    return *offset < gSRAMSize;
+}
+
+// An SRAM cart with random contents everywhere on the bus, HostImage holds the save in bus order.
+static void sram_insert(uint32_t size, bool banked)
+{
+    fill_random(SimSram, sizeof(SimSram));
+    memcpy(SimSramBefore, SimSram, sizeof(SimSram));
+    gFramPresent = 0;
+    gSRAMPresent = 1;
+    gSRAMSize = size;
+    gSRAMBanked = banked;
+    memset(HostImage, 0, sizeof(HostImage));
+    for (uint32_t Bus = 0; Bus < sizeof(SimSram); Bus += 1) {
+        uint32_t Offset;
+        if (sram_save_offset(Bus, &Offset) != false) {
+            HostImage[Offset] = SimSram[Bus];
+        }
+    }
+
+    savecache_init();
+    SimRunCount = 0;
+    SimSramReads = 0;
+    SimSramLatches = 0;
+    SimSramFlaky = false;
+    SimSramStuck = SIM_SRAM_NOT_STUCK;
+    ExpectedRunCount = 0;
+}
+
+// The host sees SRAM byte flipped in ROM.FLA and in ROMF.RAM, fromf picks the file the sectors go through.
+static void sram_host_write(uint32_t offset, uint32_t length, bool fromf)
+{
+    for (uint32_t i = 0; i < length; i += SAVECACHE_SECTOR_SIZE) {
+        uint16_t Sector[SAVECACHE_SECTOR_SIZE / 2];
+        memcpy(Sector, &HostImage[offset + i], sizeof(Sector));
+        flip16_buffer(Sector, sizeof(Sector));
+        savecache_write(offset + i, (const uint8_t*)Sector, fromf);
+    }
+}
+
+// Both files read back as the byte flipped image, past the end of the save as zeros.
+static void check_sram_read(const char *name, uint32_t offset)
+{
+    uint16_t Expected[SAVECACHE_SECTOR_SIZE / 2];
+    memset(Expected, 0, sizeof(Expected));
+    if (offset < gSRAMSize) {
+        memcpy(Expected, &HostImage[offset], sizeof(Expected));
+        flip16_buffer(Expected, sizeof(Expected));
+    }
+
+    for (uint32_t File = 0; File < 2; File += 1) {
+        uint8_t Sector[SAVECACHE_SECTOR_SIZE];
+        savecache_read(offset, Sector, File != 0);
+        if (memcmp(Sector, Expected, sizeof(Sector)) != 0) {
+            printf("%s: %s at %05x does not read back flipped\n", name, (File != 0) ? "ROMF.RAM" : "ROM.FLA", offset);
+            Failures += 1;
+        }
+    }
+}
+
+static void expect_run(uint32_t offset, uint32_t count)
+{
+    ExpectedRuns[ExpectedRunCount].Offset = offset;
+    ExpectedRuns[ExpectedRunCount].Count = count;
+    ExpectedRunCount += 1;
+}
+
+// Write back and compare the runs with the expected ones, the page reads and the counted programs and rewrites.
+// The save has to end up in place on the bus and nothing outside of it may change.
+static void check_sram_write_back(const char *name, uint32_t reads, uint32_t programs, uint32_t rewrites)
+{
+    run_write_back();
+    uint32_t Count = (SimRunCount < ExpectedRunCount) ? SimRunCount : ExpectedRunCount;
+    for (uint32_t i = 0; i < Count; i += 1) {
+        if ((SimRuns[i].Offset != ExpectedRuns[i].Offset) || (SimRuns[i].Count != ExpectedRuns[i].Count)) {
+            printf("%s: run %u is %u halfwords at %05x, expected %u at %05x\n", name, i, SimRuns[i].Count,
+                   SimRuns[i].Offset, ExpectedRuns[i].Count, ExpectedRuns[i].Offset);
+            Failures += 1;
+            break;
+        }
+    }
+
+    if (SimRunCount != ExpectedRunCount) {
+        printf("%s: %u runs, expected %u\n", name, SimRunCount, ExpectedRunCount);
+        Failures += 1;
+    }
+
+    if ((SimSramReads != reads) || (gSavePrograms != programs) || (gSaveRewrites != rewrites)) {
+        printf("%s: %u page reads, %u programs and %u rewrites, expected %u, %u and %u\n", name, SimSramReads,
+               gSavePrograms, gSaveRewrites, reads, programs, rewrites);
+        Failures += 1;
+    }
+
+    for (uint32_t Bus = 0; Bus < sizeof(SimSram); Bus += 1) {
+        uint32_t Offset;
+        uint8_t Expected = (sram_save_offset(Bus, &Offset) != false) ? HostImage[Offset] : SimSramBefore[Bus];
+        if (SimSram[Bus] != Expected) {
+            printf("%s: bus byte %05x is %02x, expected %02x\n", name, Bus, SimSram[Bus], Expected);
+            Failures += 1;
+            break;
+        }
+    }
+
+    if (savecache_step() != false) {
+        printf("%s: pages are left after the write-back\n", name);
+        Failures += 1;
+    }
+}
+
+// Banks follow each other in the save and sit SRAM_BANK_STRIDE apart on the bus.
+static void test_sram_bus_address(void)
+{
+    static const uint32_t Cases[][3] = {
+        { false, 0x00000, 0x08000000 },
+        { false, 0x07FFE, 0x08007FFE },
+        { true, 0x00000, 0x08000000 },
+        { true, 0x07FFE, 0x08007FFE },
+        { true, 0x08000, 0x08040000 },
+        { true, 0x0C100, 0x08044100 },
+        { true, 0x10000, 0x08080000 },
+        { true, 0x17FFE, 0x08087FFE },
+    };
+
+    for (uint32_t i = 0; i < (sizeof(Cases) / sizeof(Cases[0])); i += 1) {
+        gSRAMBanked = (Cases[i][0] != 0);
+        uint32_t Bus = sram_bus_address(Cases[i][1]);
+        if (Bus != Cases[i][2]) {
+            printf("sram bus address: %05x maps to %08x, expected %08x\n", Cases[i][1], Bus, Cases[i][2]);
+            Failures += 1;
+        }
+    }
+}
+
+// Only the changed halfword runs are written, each with one latch, and one more read verifies them.
+static void test_sram_runs(void)
+{
+    sram_insert(SRAM_SIZE, false);
+    check_sram_read("sram runs", 0);
+    for (uint32_t i = 6; i < 12; i += 1) {
+        HostImage[i] ^= 0x5A;
+    }
+
+    HostImage[80] ^= 0x01;
+    HostImage[(3 * SAVECACHE_PAGE_SIZE) + 127] ^= 0x80;
+    sram_host_write(0, SAVECACHE_SECTOR_SIZE, false);
+    check_sram_read("sram runs", 0);
+    expect_run(6, 3);
+    expect_run(80, 1);
+    expect_run((3 * SAVECACHE_PAGE_SIZE) + 126, 1);
+    check_sram_write_back("sram runs", 4, 3, 0);
+}
+
+// ROMF.RAM writes the same bytes into the SRAM as ROM.FLA.
+static void test_sram_romf(void)
+{
+    sram_insert(SRAM_SIZE, false);
+    HostImage[SRAM_SIZE - 2] ^= 0xFF;
+    sram_host_write(SRAM_SIZE - SAVECACHE_SECTOR_SIZE, SAVECACHE_SECTOR_SIZE, true);
+    check_sram_read("sram romf", SRAM_SIZE - SAVECACHE_SECTOR_SIZE);
+    expect_run(SRAM_SIZE - 2, 1);
+    check_sram_write_back("sram romf", 2, 1, 0);
+}
+
+// The runs a flaky bus loses show up in the verify read and are written again, until a read shows the page clean.
+static void test_sram_flaky(void)
+{
+    sram_insert(SRAM_SIZE, false);
+    SimSramFlaky = true;
+    for (uint32_t i = 6; i < 12; i += 1) {
+        HostImage[i] ^= 0x5A;
+    }
+
+    HostImage[80] ^= 0x5A;
+    for (uint32_t i = 100; i < 106; i += 1) {
+        HostImage[i] ^= 0x5A;
+    }
+
+    sram_host_write(0, SAVECACHE_SECTOR_SIZE, false);
+    expect_run(6, 3);
+    expect_run(80, 1);
+    expect_run(100, 3);
+    expect_run(6, 1);
+    expect_run(100, 1);
+    expect_run(100, 1);
+    check_sram_write_back("sram flaky", 4, 3, 3);
+}
+
+// A halfword that never sticks ends the page after the last pass, the write-back does not hang on it.
+static void test_sram_stuck(void)
+{
+    sram_insert(SRAM_SIZE, false);
+    SimSramStuck = 200;
+    for (uint32_t i = 200; i < 204; i += 1) {
+        HostImage[i] ^= 0x5A;
+    }
+
+    sram_host_write(0, SAVECACHE_SECTOR_SIZE, false);
+    expect_run(200, 2);
+    expect_run(200, 1);
+    expect_run(200, 1);
+    expect_run(200, 1);
+    HostImage[200] = SimSramBefore[200];
+    HostImage[201] = SimSramBefore[201];
+    check_sram_write_back("sram stuck", 4, 1, 3);
+}
+
+// A banked SRAM reads in bank order and every bank is written at its own bus address, the 128KB file ends with
+// zeros that ignore writes.
+static void test_sram_banks(void)
+{
+    sram_insert(SRAM_BANK_SIZE * SRAM_BANKS, true);
+    for (uint32_t Offset = 0; Offset < SAVECACHE_SIZE; Offset += SRAM_BANK_SIZE / 2) {
+        check_sram_read("sram banks", Offset);
+        check_sram_read("sram banks", Offset + (SRAM_BANK_SIZE / 2) - SAVECACHE_SECTOR_SIZE);
+    }
+
+    HostImage[SRAM_BANK_SIZE - 1] ^= 0x5A;
+    HostImage[SRAM_BANK_SIZE] ^= 0x5A;
+    HostImage[(2 * SRAM_BANK_SIZE) + 256] ^= 0x5A;
+    HostImage[(3 * SRAM_BANK_SIZE)] ^= 0x5A;
+    sram_host_write(SRAM_BANK_SIZE - SAVECACHE_SECTOR_SIZE, 2 * SAVECACHE_SECTOR_SIZE, false);
+    sram_host_write(2 * SRAM_BANK_SIZE, SAVECACHE_SECTOR_SIZE, false);
+    sram_host_write(3 * SRAM_BANK_SIZE, SAVECACHE_SECTOR_SIZE, false);
+    HostImage[(3 * SRAM_BANK_SIZE)] = 0;
+    check_sram_read("sram banks", 3 * SRAM_BANK_SIZE);
+    expect_run(SRAM_BANK_SIZE - 2, 1);
+    expect_run(SRAM_BANK_SIZE, 1);
+    expect_run((2 * SRAM_BANK_SIZE) + 256, 1);
+    check_sram_write_back("sram banks", 6, 3, 0);
+    if ((SimSram[0x7FFF] != HostImage[SRAM_BANK_SIZE - 1]) || (SimSram[0x40000] != HostImage[SRAM_BANK_SIZE]) ||
+        (SimSram[0x80100] != HostImage[(2 * SRAM_BANK_SIZE) + 256])) {
+        printf("sram banks: the banks are not at 0x00000, 0x40000 and 0x80000\n");
+        Failures += 1;
+    }
+}
+
+int main(void)
+{
+    test_poll_schedule();
+    test_clear_bits();
+    test_partial();
+    test_sectors();
+    test_whole_file();
+    test_whole_file_unchanged_sector();
+    test_unchanged();
+    test_write_during_erase();
+    test_write_after_program();
+    test_sram_bus_address();
+    test_sram_runs();
+    test_sram_romf();
+    test_sram_flaky();
+    test_sram_stuck();
+    test_sram_banks();
+
+    if (Failures != 0) {
+        printf("savecache_test: %d failures\n", Failures);
+        return 1;
+    }
+
+    printf("savecache_test: ok\n");
+    return 0;
+}
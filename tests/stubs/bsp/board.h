@@ -0,0 +1,10 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Host stand-in for the tinyusb board header, the firmware only needs the pico-sdk types it pulls in.
+ */
+
+#pragma once
+
+#include "pico/stdlib.h"
@@ -0,0 +1,36 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Host stand-in for the pico-sdk header. The tests run on a single thread, the spin locks do nothing.
+ */
+
+#pragma once
+
+#include "pico/stdlib.h"
+
+typedef uint32_t spin_lock_t;
+
+static inline int spin_lock_claim_unused(bool required)
+{
+    (void)required;
+    return 0;
+}
+
+static inline spin_lock_t *spin_lock_init(uint lock_num)
+{
+    static spin_lock_t Locks[32];
+    return &Locks[lock_num];
+}
+
+static inline uint32_t spin_lock_blocking(spin_lock_t *lock)
+{
+    (void)lock;
+    return 0;
+}
+
+static inline void spin_unlock(spin_lock_t *lock, uint32_t saved_irq)
+{
+    (void)lock;
+    (void)saved_irq;
+}
@@ -0,0 +1,29 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * Host stand-in for the tinyusb header, only the mass storage parts the virtual disk uses.
+ * tud_msc_set_sense is implemented by the test, the callbacks by the firmware.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+
+#define CFG_TUD_MSC 1
+
+enum {
+    SCSI_SENSE_NONE = 0x00,
+    SCSI_SENSE_NOT_READY = 0x02,
+    SCSI_SENSE_ILLEGAL_REQUEST = 0x05,
+};
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size);
+bool tud_msc_test_unit_ready_cb(uint8_t lun);
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize);
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize);
@@ -0,0 +1,657 @@
+/**
+ * SPX-License-Identifier: BSD-2-Clause
+ * Copyright (c) 2023 - NopJne
+ *
+ * VirtualDisk test
+ * Mounts the virtual disk through the tinyusb callbacks for 4, 12 and 64MB ROMs with and without saves, plus a 1MB
+ * homebrew ROM for the smallest clusters, and reads it back like a host would. The MBR and boot sector have to
+ * describe a FAT16 volume of at most 4160 clusters with the smallest cluster size that fits the files, the root
+ * directory has to list the files of the cart and every file has to start at the sector its first cluster maps to.
+ * The fakes fill sectors with their source, byte order and offset, so a file mapped to the wrong sectors reads back
+ * the wrong tag.
+ * Both FAT copies are walked from every directory entry: each chain has to end in an end of chain mark after as
+ * many clusters as the file needs, every cluster has to read back the part of the file it holds, no cluster may
+ * belong to two chains and no other entry may be in use. The metadata is only rendered again after a load of the
+ * medium, a cart change without one keeps the old layout.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "tusb.h"
+#include "n64cartinterface.h"
+#include "cartbus.h"
+#include "timing.h"
+#include "romcache.h"
+#include "prefetch.h"
+#include "flashcache.h"
+#include "romhash.h"
+#include "savecache.h"
+
+#define SECTOR_SIZE (512)
+
+// The volume the layout has to stay within.
+#define VOLUME_CLUSTERS      (4160)
+#define FAT16_MIN_CLUSTERS   (4085)
+#define CLUSTER_MAX_SHIFT    (6)
+#define ROOT_ENTRIES         (512)
+#define ROOT_SECTORS         ((ROOT_ENTRIES * 32) / SECTOR_SIZE)
+#define FAT_SECTORS          ((((2 + VOLUME_CLUSTERS) * 2) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+
+#define SAVE_FILE_SIZE       (128 * 1024)
+#define CARTTEST_FILE_SIZE   (2 * 1024)
+#define HASHES_FILE_SIZE     (512)
+
+// Fake sector contents: every word holds the source tag, the byte order and its byte offset in the file.
+#define TAG_ROM    (0x10000000u)
+#define TAG_SAVE   (0x50000000u)
+#define TAG_EEPROM (0xE0000000u)
+#define TAG_FLIP   (0x08000000u)
+
+#define HASHES_TEXT "HASHES\n"
+
+enum FILE_KIND {
+    FILE_EEPROM,
+    FILE_SAVE,
+    FILE_ROM,
+    FILE_CARTTEST,
+    FILE_HASHES,
+};
+
+typedef struct _ExpectedFile
+{
+    const char *Name;
+    uint32_t Kind;
+    bool Flip;
+    uint32_t Size;
+} ExpectedFile;
+
+typedef struct _Volume
+{
+    uint32_t Sectors;
+    uint32_t Shift;
+    uint32_t FatLba;
+    uint32_t RootLba;
+    uint32_t DataLba;
+    uint32_t Clusters;
+} Volume;
+
+typedef struct _VolumeFile
+{
+    char Name[12];
+    uint32_t Cluster;
+    uint32_t Size;
+} VolumeFile;
+
+volatile bool gCartReady = false;
+volatile bool gCartMissing = false;
+uint32_t gRomSize = 0;
+uint32_t gRomSizeProbeUs = 0;
+uint32_t gFramPresent = 0;
+uint32_t gSRAMPresent = 0;
+bool gSRAMBanked = false;
+uint8_t gFlashType = 0;
+uint32_t gCICType = 0;
+uint16_t gGameTitle[0x16];
+uint16_t gGameCode[6];
+const char *gCICName = "6102";
+CartBusTiming gCartBusTiming;
+bool gCartBusCalibrated = false;
+uint32_t gSysClockHz = 0;
+uint32_t gBootPhaseUs[BOOT_PHASE_COUNT];
+uint32_t gRomCacheHits = 0;
+uint32_t gRomCacheMisses = 0;
+uint32_t gRomCachePrefetchHits = 0;
+uint32_t gPrefetchIssued = 0;
+bool gFlashCacheAttached = false;
+uint32_t gFlashCacheHits = 0;
+uint32_t gFlashCacheStored = 0;
+uint32_t gEepromSize = 0;
+uint32_t gEepromBlocksWritten = 0;
+uint32_t gEepromWriteUs = 0;
+uint32_t gEepromWriteErrors = 0;
+enum SAVE_TYPE gSaveType = SAVE_TYPE_NONE;
+uint32_t gSaveWriteBacks = 0;
+uint32_t gSaveErases = 0;
+uint32_t gSavePrograms = 0;
+uint32_t gSaveRewrites = 0;
+bool gSaveChipErased = false;
+uint32_t gSaveWriteBackMs = 0;
+
+static uint16_t Fat[2][FAT_SECTORS * (SECTOR_SIZE / 2)];
+static bool ClusterUsed[VOLUME_CLUSTERS + 2];
+
+// The last sense the disk reported and how often the save was flushed.
+static uint8_t SenseKey = 0;
+static uint8_t SenseCode = 0;
+static uint32_t Flushes = 0;
+
+// The last write a save or EEPROM file passed on.
+static uint32_t LastWriteTag = 0;
+static uint32_t LastWriteOffset = 0;
+static uint32_t WriteCount = 0;
+
+static int Failures = 0;
+
+uint32_t time_us_32(void)
+{
+    return 0x12345678;
+}
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier)
+{
+    (void)lun;
+    (void)add_sense_qualifier;
+    SenseKey = sense_key;
+    SenseCode = add_sense_code;
+    return true;
+}
+
+static void fill_tagged(uint8_t *buffer, uint32_t length, uint32_t tag, bool flip, uint32_t offset)
+{
+    for (uint32_t i = 0; i < length; i += 4) {
+        uint32_t Word = tag | ((flip != false) ? TAG_FLIP : 0) | (offset + i);
+        memcpy(&buffer[i], &Word, 4);
+    }
+}
+
+bool romcache_try_read(uint32_t address, uint16_t *buffer, uint32_t length, bool flip)
+{
+    fill_tagged((uint8_t*)buffer, length, TAG_ROM, flip, address - CART_ADDRESS_START);
+    return true;
+}
+
+void prefetch_request(uint32_t address, uint32_t length)
+{
+    (void)address;
+    (void)length;
+}
+
+void prefetch_notify(uint32_t address, uint32_t length)
+{
+    (void)address;
+    (void)length;
+}
+
+void savecache_read(uint32_t offset, uint8_t *buffer, bool flip)
+{
+    fill_tagged(buffer, SECTOR_SIZE, TAG_SAVE, flip, offset);
+}
+
+void savecache_write(uint32_t offset, const uint8_t *buffer, bool flip)
+{
+    (void)buffer;
+    LastWriteTag = TAG_SAVE | ((flip != false) ? TAG_FLIP : 0);
+    LastWriteOffset = offset;
+    WriteCount += 1;
+}
+
+void savecache_flush(void)
+{
+    Flushes += 1;
+}
+
+uint32_t savecache_erase_us(void)
+{
+    return 0;
+}
+
+uint32_t savecache_program_us(void)
+{
+    return 0;
+}
+
+void ReadEepromShadow(uint32_t address, uint8_t *buffer, bool flip)
+{
+    fill_tagged(buffer, SECTOR_SIZE, TAG_EEPROM, flip, address);
+}
+
+void WriteEepromShadow(uint32_t address, const uint8_t *buffer, bool flip)
+{
+    (void)buffer;
+    LastWriteTag = TAG_EEPROM | ((flip != false) ? TAG_FLIP : 0);
+    LastWriteOffset = address;
+    WriteCount += 1;
+}
+
+uint32_t romhash_report(char *buffer, uint32_t size)
+{
+    return (uint32_t)snprintf(buffer, size, HASHES_TEXT);
+}
+
+static uint16_t get16(const uint8_t *data)
+{
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+static uint32_t get32(const uint8_t *data)
+{
+    return (uint32_t)get16(data) | ((uint32_t)get16(data + 2) << 16);
+}
+
+static void read_sector(uint32_t lba, uint8_t *buffer)
+{
+    int32_t Length = tud_msc_read10_cb(0, lba, 0, buffer, SECTOR_SIZE);
+    if (Length != SECTOR_SIZE) {
+        printf("read of sector %u returned %d\n", lba, Length);
+        Failures += 1;
+        memset(buffer, 0, SECTOR_SIZE);
+    }
+}
+
+// The files the cart should show, in volume order.
+static uint32_t expected_files(ExpectedFile *files)
+{
+    uint32_t Count = 0;
+    if (gEepromSize != 0) {
+        files[Count] = (ExpectedFile){ "ROM     EEP", FILE_EEPROM, false, gEepromSize };
+        Count += 1;
+    }
+
+    if ((gSRAMPresent != 0) || (gFramPresent != 0)) {
+        files[Count] = (ExpectedFile){ "ROM     FLA", FILE_SAVE, false, SAVE_FILE_SIZE };
+        Count += 1;
+    }
+
+    files[Count] = (ExpectedFile){ "ROM     N64", FILE_ROM, false, gRomSize };
+    Count += 1;
+    files[Count] = (ExpectedFile){ "ROMF    Z64", FILE_ROM, true, gRomSize };
+    Count += 1;
+    if (gFramPresent != 0) {
+        files[Count] = (ExpectedFile){ "ROMF    FLA", FILE_SAVE, true, SAVE_FILE_SIZE };
+        Count += 1;
+    } else if (gSRAMPresent != 0) {
+        files[Count] = (ExpectedFile){ "ROMF    RAM", FILE_SAVE, true, SAVE_FILE_SIZE };
+        Count += 1;
+    }
+
+    if (gEepromSize != 0) {
+        files[Count] = (ExpectedFile){ "ROMF    EEP", FILE_EEPROM, true, gEepromSize };
+        Count += 1;
+    }
+
+    files[Count] = (ExpectedFile){ "CARTTESTTXT", FILE_CARTTEST, false, CARTTEST_FILE_SIZE };
+    Count += 1;
+    files[Count] = (ExpectedFile){ "HASHES  TXT", FILE_HASHES, false, HASHES_FILE_SIZE };
+    Count += 1;
+    return Count;
+}
+
+// The smallest cluster size that gives every file whole clusters within the volume.
+static uint32_t expected_shift(const ExpectedFile *files, uint32_t count)
+{
+    for (uint32_t Shift = 0; Shift < CLUSTER_MAX_SHIFT; Shift += 1) {
+        uint32_t ClusterSize = SECTOR_SIZE << Shift;
+        uint32_t Clusters = 0;
+        for (uint32_t i = 0; i < count; i += 1) {
+            Clusters += (files[i].Size + ClusterSize - 1) / ClusterSize;
+        }
+
+        if (Clusters <= VOLUME_CLUSTERS) {
+            return Shift;
+        }
+    }
+
+    return CLUSTER_MAX_SHIFT;
+}
+
+static uint32_t tag_of(const ExpectedFile *file)
+{
+    uint32_t Tag = (file->Kind == FILE_ROM) ? TAG_ROM : ((file->Kind == FILE_SAVE) ? TAG_SAVE : TAG_EEPROM);
+    return Tag | ((file->Flip != false) ? TAG_FLIP : 0);
+}
+
+// The sector at lba has to be the sector at offset of the file.
+static void check_file_sector(const char *name, const ExpectedFile *file, uint32_t lba, uint32_t offset)
+{
+    uint8_t Sector[SECTOR_SIZE];
+    read_sector(lba, Sector);
+    if (file->Kind == FILE_CARTTEST) {
+        static const char Header[] = "\nCart tester report:";
+        if ((offset == 0) && (memcmp(Sector, Header, sizeof(Header) - 1) != 0)) {
+            printf("%s: %.11s at sector %u is not the report\n", name, file->Name, lba);
+            Failures += 1;
+        }
+
+        return;
+    }
+
+    if (file->Kind == FILE_HASHES) {
+        if (memcmp(Sector, HASHES_TEXT, sizeof(HASHES_TEXT)) != 0) {
+            printf("%s: %.11s at sector %u is not the hash report\n", name, file->Name, lba);
+            Failures += 1;
+        }
+
+        return;
+    }
+
+    uint32_t Word = get32(Sector);
+    uint32_t Last = get32(&Sector[SECTOR_SIZE - 4]);
+    uint32_t Expected = tag_of(file) | offset;
+    if ((Word != Expected) || (Last != (Expected + SECTOR_SIZE - 4))) {
+        printf("%s: %.11s sector %u reads %08x, expected %08x\n", name, file->Name, lba, Word, Expected);
+        Failures += 1;
+    }
+}
+
+// MBR and boot sector against the geometry the files need.
+static bool check_geometry(const char *name, uint32_t shift, Volume *volume)
+{
+    uint32_t Capacity = 0;
+    uint16_t BlockSize = 0;
+    tud_msc_capacity_cb(0, &Capacity, &BlockSize);
+
+    uint8_t Mbr[SECTOR_SIZE];
+    uint8_t Boot[SECTOR_SIZE];
+    read_sector(0, Mbr);
+    read_sector(1, Boot);
+    const uint8_t *Partition = &Mbr[SECTOR_SIZE - 2 - 64];
+    if ((Partition[4] != 0x0E) || (get32(&Partition[8]) != 1) || (get32(&Partition[12]) != (Capacity - 1)) ||
+        (get16(&Mbr[SECTOR_SIZE - 2]) != 0xAA55) || (BlockSize != SECTOR_SIZE)) {
+        printf("%s: the MBR does not describe a FAT16 partition over the %u sectors of the disk\n", name, Capacity);
+        Failures += 1;
+        return false;
+    }
+
+    uint32_t Sectors = get16(&Boot[0x13]);
+    if (Sectors == 0) {
+        Sectors = get32(&Boot[0x20]);
+    }
+
+    uint32_t FatSectors = get16(&Boot[0x16]);
+    uint32_t ReservedSectors = get16(&Boot[0x0E]);
+    if ((get16(&Boot[0x0B]) != SECTOR_SIZE) || (Boot[0x0D] != (1u << shift)) || (ReservedSectors != 1) ||
+        (Boot[0x10] != 2) || (get16(&Boot[0x11]) != ROOT_ENTRIES) || (Boot[0x15] != 0xF8) ||
+        (FatSectors != FAT_SECTORS) || (get32(&Boot[0x1C]) != 1) || (Sectors != (Capacity - 1)) ||
+        (get16(&Boot[SECTOR_SIZE - 2]) != 0xAA55)) {
+        printf("%s: the boot sector does not match %u sectors per cluster\n", name, 1u << shift);
+        Failures += 1;
+        return false;
+    }
+
+    volume->Sectors = Capacity;
+    volume->Shift = shift;
+    volume->FatLba = 1 + ReservedSectors;
+    volume->RootLba = volume->FatLba + (2 * FatSectors);
+    volume->DataLba = volume->RootLba + ROOT_SECTORS;
+    volume->Clusters = (Capacity - volume->DataLba) >> shift;
+    if ((volume->Clusters > VOLUME_CLUSTERS) || (volume->Clusters < FAT16_MIN_CLUSTERS)) {
+        printf("%s: %u clusters, FAT16 with at most %u expected\n", name, volume->Clusters, VOLUME_CLUSTERS);
+        Failures += 1;
+        return false;
+    }
+
+    return true;
+}
+
+// The short name entries of the root directory, long names and the volume label are skipped.
+static uint32_t read_root_directory(const Volume *volume, VolumeFile *files, uint32_t max)
+{
+    uint32_t Count = 0;
+    for (uint32_t Sector = 0; Sector < ROOT_SECTORS; Sector += 1) {
+        uint8_t Entries[SECTOR_SIZE];
+        read_sector(volume->RootLba + Sector, Entries);
+        for (uint32_t i = 0; i < SECTOR_SIZE; i += 32) {
+            const uint8_t *Entry = &Entries[i];
+            if (Entry[0] == 0) {
+                return Count;
+            }
+
+            if ((Entry[11] == 0x0F) || ((Entry[11] & 0x08) != 0) || (Count == max)) {
+                continue;
+            }
+
+            memcpy(files[Count].Name, Entry, 11);
+            files[Count].Name[11] = 0;
+            files[Count].Cluster = get16(&Entry[26]) | ((uint32_t)get16(&Entry[20]) << 16);
+            files[Count].Size = get32(&Entry[28]);
+            Count += 1;
+        }
+    }
+
+    return Count;
+}
+
+// Every file takes whole clusters right after the previous one, its first and last sector have to read back as
+// the start and end of the file and a write to a save or EEPROM file has to reach it at the right offset.
+static void check_extents(const char *name, const Volume *volume, const ExpectedFile *expected, uint32_t count,
+                          const VolumeFile *files)
+{
+    uint32_t ClusterSize = SECTOR_SIZE << volume->Shift;
+    uint32_t Cluster = 2;
+    for (uint32_t i = 0; i < count; i += 1) {
+        const ExpectedFile *File = &expected[i];
+        if (files[i].Cluster != Cluster) {
+            printf("%s: %.11s starts at cluster %u, expected %u\n", name, File->Name, files[i].Cluster, Cluster);
+            Failures += 1;
+            return;
+        }
+
+        uint32_t Lba = volume->DataLba + ((Cluster - 2) << volume->Shift);
+        uint32_t LastOffset = ((File->Size - 1) / SECTOR_SIZE) * SECTOR_SIZE;
+        check_file_sector(name, File, Lba, 0);
+        check_file_sector(name, File, Lba + (LastOffset / SECTOR_SIZE), LastOffset);
+        if ((File->Kind == FILE_EEPROM) || (File->Kind == FILE_SAVE) || (File->Kind == FILE_ROM)) {
+            uint8_t Sector[SECTOR_SIZE] = { 0 };
+            uint32_t Writes = WriteCount;
+            tud_msc_write10_cb(0, Lba + (LastOffset / SECTOR_SIZE), 0, Sector, SECTOR_SIZE);
+            bool Writable = (File->Kind != FILE_ROM);
+            if ((WriteCount != (Writes + (Writable ? 1 : 0))) ||
+                ((Writable != false) && ((LastWriteTag != tag_of(File)) || (LastWriteOffset != LastOffset)))) {
+                printf("%s: a write to the last sector of %.11s did not reach it\n", name, File->Name);
+                Failures += 1;
+            }
+        }
+
+        Cluster += (File->Size + ClusterSize - 1) / ClusterSize;
+    }
+
+    if ((Cluster - 2) > volume->Clusters) {
+        printf("%s: the files take %u clusters, the volume has %u\n", name, Cluster - 2, volume->Clusters);
+        Failures += 1;
+    }
+}
+
+// Follow the chain of every file through the FAT. Each cluster has to hold the next part of the file, the chain has
+// to end after the clusters the file needs and no cluster may be shared or in use without a file.
+static void check_fat(const char *name, const Volume *volume, const ExpectedFile *expected, uint32_t count,
+                      const VolumeFile *files)
+{
+    for (uint32_t Copy = 0; Copy < 2; Copy += 1) {
+        for (uint32_t Sector = 0; Sector < FAT_SECTORS; Sector += 1) {
+            uint32_t Lba = volume->FatLba + (Copy * FAT_SECTORS) + Sector;
+            read_sector(Lba, (uint8_t*)&Fat[Copy][Sector * (SECTOR_SIZE / 2)]);
+        }
+    }
+
+    if ((memcmp(Fat[0], Fat[1], sizeof(Fat[0])) != 0) || (Fat[0][0] != 0xFFF8) || (Fat[0][1] != 0xFFFF)) {
+        printf("%s: the FAT copies differ or do not start with the media descriptor\n", name);
+        Failures += 1;
+        return;
+    }
+
+    uint32_t ClusterSize = SECTOR_SIZE << volume->Shift;
+    memset(ClusterUsed, 0, sizeof(ClusterUsed));
+    for (uint32_t i = 0; i < count; i += 1) {
+        const ExpectedFile *File = &expected[i];
+        uint32_t Cluster = files[i].Cluster;
+        uint32_t Length = 0;
+        while (true) {
+            if ((Cluster < 2) || (Cluster >= (volume->Clusters + 2)) || (ClusterUsed[Cluster] != false)) {
+                printf("%s: the chain of %.11s reaches cluster %u, outside the volume or already used\n", name,
+                       File->Name, Cluster);
+                Failures += 1;
+                return;
+            }
+
+            ClusterUsed[Cluster] = true;
+            check_file_sector(name, File, volume->DataLba + ((Cluster - 2) << volume->Shift), Length * ClusterSize);
+            Length += 1;
+            if (Fat[0][Cluster] >= 0xFFF8) {
+                break;
+            }
+
+            Cluster = Fat[0][Cluster];
+        }
+
+        if (Length != ((File->Size + ClusterSize - 1) / ClusterSize)) {
+            printf("%s: the chain of %.11s is %u clusters long for %u bytes\n", name, File->Name, Length, File->Size);
+            Failures += 1;
+        }
+    }
+
+    for (uint32_t Cluster = 2; Cluster < (sizeof(Fat[0]) / sizeof(Fat[0][0])); Cluster += 1) {
+        bool Used = (Cluster < (volume->Clusters + 2)) && (ClusterUsed[Cluster] != false);
+        if ((Used == false) && (Fat[0][Cluster] != 0)) {
+            printf("%s: cluster %u is in use without a file\n", name, Cluster);
+            Failures += 1;
+            return;
+        }
+    }
+}
+
+// Probe results for a cart, a load of the medium makes the disk pick them up.
+static void cart_insert(uint32_t rom_mb, uint32_t eeprom, bool sram, bool flashram)
+{
+    gRomSize = rom_mb * 1024 * 1024;
+    gEepromSize = eeprom;
+    gSRAMPresent = (sram != false) ? 1 : 0;
+    gFramPresent = (flashram != false) ? 1 : 0;
+    gCartReady = true;
+    tud_msc_start_stop_cb(0, 0, true, true);
+}
+
+static void check_disk(const char *name, Volume *volume)
+{
+    ExpectedFile Expected[16];
+    uint32_t Count = expected_files(Expected);
+    if (check_geometry(name, expected_shift(Expected, Count), volume) == false) {
+        return;
+    }
+
+    VolumeFile Files[16];
+    uint32_t FileCount = read_root_directory(volume, Files, 16);
+    for (uint32_t i = 0; (i < Count) && (i < FileCount); i += 1) {
+        if ((strcmp(Files[i].Name, Expected[i].Name) != 0) || (Files[i].Size != Expected[i].Size)) {
+            printf("%s: file %u is %s of %u bytes, expected %s of %u\n", name, i, Files[i].Name, Files[i].Size,
+                   Expected[i].Name, Expected[i].Size);
+            Failures += 1;
+            return;
+        }
+    }
+
+    if (FileCount != Count) {
+        printf("%s: %u files, expected %u\n", name, FileCount, Count);
+        Failures += 1;
+        return;
+    }
+
+    check_extents(name, volume, Expected, Count, Files);
+    check_fat(name, volume, Expected, Count, Files);
+}
+
+static void test_carts(void)
+{
+    static const struct {
+        const char *Name;
+        uint32_t RomMB;
+        uint32_t Eeprom;
+        bool Sram;
+        bool FlashRam;
+        uint32_t Shift;
+    } Carts[] = {
+        { "1MB", 1, 0, false, false, 0 },
+        { "1MB SRAM", 1, 0, true, false, 1 },
+        { "4MB", 4, 0, false, false, 2 },
+        { "4MB EEPROM SRAM", 4, 512, true, false, 3 },
+        { "12MB", 12, 0, false, false, 4 },
+        { "12MB EEPROM FlashRAM", 12, 2048, false, true, 4 },
+        { "64MB", 64, 0, false, false, 6 },
+        { "64MB EEPROM SRAM", 64, 2048, true, false, 6 },
+        { "64MB FlashRAM", 64, 0, false, true, 6 },
+    };
+
+    for (uint32_t i = 0; i < (sizeof(Carts) / sizeof(Carts[0])); i += 1) {
+        cart_insert(Carts[i].RomMB, Carts[i].Eeprom, Carts[i].Sram, Carts[i].FlashRam);
+        Volume Disk = { 0 };
+        check_disk(Carts[i].Name, &Disk);
+        if (Disk.Shift != Carts[i].Shift) {
+            printf("%s: %u sectors per cluster, expected %u\n", Carts[i].Name, 1u << Disk.Shift,
+                   1u << Carts[i].Shift);
+            Failures += 1;
+        }
+    }
+}
+
+// Nothing is served before the probe. The layout is rendered on the first access once the cart reads ready and
+// stays as it is, a load of the medium marks it stale and the next access renders it for the cart as it is then.
+// An eject flushes the save and reports the medium as gone.
+static void test_stale_layout(void)
+{
+    uint32_t Capacity = 0;
+    uint16_t BlockSize = 0;
+    uint8_t Sector[SECTOR_SIZE] = { 0 };
+    gCartReady = false;
+    tud_msc_start_stop_cb(0, 0, true, true);
+    tud_msc_capacity_cb(0, &Capacity, &BlockSize);
+    if ((Capacity != 0) || (tud_msc_read10_cb(0, 0, 0, Sector, SECTOR_SIZE) != 0) ||
+        (tud_msc_write10_cb(0, 0, 0, Sector, SECTOR_SIZE) != 0) || (tud_msc_test_unit_ready_cb(0) != false) ||
+        (SenseKey != SCSI_SENSE_NOT_READY) || (SenseCode != 0x04)) {
+        printf("stale: the disk is served before the cart is probed\n");
+        Failures += 1;
+    }
+
+    gRomSize = 4 * 1024 * 1024;
+    gEepromSize = 0;
+    gSRAMPresent = 0;
+    gFramPresent = 0;
+    gCartReady = true;
+    Volume Before = { 0 };
+    check_disk("stale first render", &Before);
+
+    // The cart state changes without a load, the disk keeps serving the first render.
+    gRomSize = 64 * 1024 * 1024;
+    gEepromSize = 2048;
+    gSRAMPresent = 1;
+    tud_msc_start_stop_cb(0, 1, true, false);
+    VolumeFile Files[16];
+    uint32_t FileCount = read_root_directory(&Before, Files, 16);
+    tud_msc_capacity_cb(0, &Capacity, &BlockSize);
+    read_sector(1, Sector);
+    if ((Capacity != Before.Sectors) || (Sector[0x0D] != (1u << Before.Shift)) || (FileCount != 4) ||
+        (Files[0].Size != (4 * 1024 * 1024))) {
+        printf("stale: the metadata was rendered again without a load\n");
+        Failures += 1;
+    }
+
+    tud_msc_start_stop_cb(0, 0, true, true);
+    Volume After = { 0 };
+    check_disk("stale rerender", &After);
+    if ((After.Sectors == Before.Sectors) || (After.Shift != 6)) {
+        printf("stale: the load did not render the metadata for the new cart\n");
+        Failures += 1;
+    }
+
+    uint32_t FlushesBefore = Flushes;
+    tud_msc_start_stop_cb(0, 0, false, true);
+    if ((Flushes != (FlushesBefore + 1)) || (tud_msc_test_unit_ready_cb(0) != false) ||
+        (SenseKey != SCSI_SENSE_NOT_READY) || (SenseCode != 0x3A)) {
+        printf("stale: the eject did not flush the save and report the medium as gone\n");
+        Failures += 1;
+    }
+}
+
+int main(void)
+{
+    test_carts();
+    test_stale_layout();
+
+    if (Failures != 0) {
+        printf("virtualdisk_test: %d failures\n", Failures);
+        return 1;
+    }
+
+    printf("virtualdisk_test: ok\n");
+    return 0;
+}